@@ -37,9 +37,14 @@ For more information, please refer to <http://unlicense.org/>
 // louder)
 #define MAX_SIMULTANEOUS_NOTES 10
 
+// how big the sound card's buffer is if you don't ask for a particular size (see --buffer)
+#define DEFAULT_LATENCY_US 10000
+
 #ifndef _GNU_SOURCE
 #define _GNU_SOURCE
 #endif
+// 64-bit off_t, so that offsets into soundfonts over 2GB work
+#define _FILE_OFFSET_BITS 64
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -56,6 +61,9 @@ For more information, please refer to <http://unlicense.org/>
 #include <signal.h>
 
 #include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <alsa/asoundlib.h>
 
 typedef int8_t i8;
@@ -117,38 +125,78 @@ static void warn(char const *fmt, ...) {
 	fprintf(stderr, "\n");
 }
 
-typedef struct {
-	u16 gen_ndx;
-	u16 mod_ndx;
-} Bag;
+static unsigned long page_size;
+
+// read one byte from every page in [data, data+size), so that accessing it later won't page fault
+static void prefault(void const *data, size_t size) {
+	volatile char const *p = data;
+	for (size_t i = 0; i < size; i += page_size)
+		(void)p[i];
+	if (size) (void)p[size - 1];
+}
 
 typedef struct {
 	u16 start;
 	u16 end;
 } GenZone;
 
+// a preset zone, resolved to an instrument
+typedef struct {
+	u8 key_lo, key_hi;
+	u8 vel_lo, vel_hi;
+	u16 inst; // index into SoundFont.insts
+} PresetZone;
+
 typedef struct {
 	char name[21]; // 21 because i'm not sure if it's necessarily null-terminated
-	u16 preset, bank, bag_ndx;
-	u32 library, genre, morphology;
-	u32 nbags;
-	Bag *bags;
+	u16 preset, bank;
+	u32 first_zone; // index into SoundFont.preset_zones
+	u32 nzones;
 } Preset;
 
 typedef struct {
 	u32 count;
+	u32 resident; // number of samples in data. if this is less than count, the rest have to be streamed (see Streamer)
 	u32 sample_rate; // original sample rate
-	u8 pitch; // original MIDI pitch
-	i16 data[1];
+	u16 sample_id; // index into SoundFont.shdrs
+	u32 loop_start, loop_end; // relative to data
+	i64 file_offset; // where data[0] is in the soundfont file
+	i16 *data; // owned by SoundFont.sample_cache
 } Samples;
 
+typedef enum {
+	LOOP_NONE = 0,
+	LOOP_CONTINUOUS = 1,
+	LOOP_UNTIL_RELEASE = 3 // loop while the key is down, then play the rest of the sample
+} LoopMode;
+
+// how many samples past the end of a loop to keep when trimming samples (see compute_sample_load_counts)
+#define LOOP_GUARD 8
+
+// what to play for a particular key/velocity, resolved from the instrument's generators when it's loaded
+typedef struct {
+	Samples *samples_L, *samples_R; // these are the same for mono samples
+	LoopMode loop_mode; // loop points are in samples_L
+	u8 root_key; // MIDI key which plays the samples at their original pitch
+	i32 tuning; // cents to add to the pitch
+	i32 scale_tuning; // cents per key (normally 100)
+	float gain_L, gain_R; // from initialAttenuation, and pan for mono samples
+} Zone;
+
+#define NO_ZONE U16_MAX
+
 typedef struct {
 	char name[21];
 	bool samples_loaded;
 	u16 bag_ndx;
+	u64 last_used; // time_ns() when this was last selected/played, for evicting instruments
+	u32 voice_refs; // number of voices (and queued note on events) using this. accessed atomically.
 	u32 ngen_zones;
-	GenZone *gen_zones;
-	Samples *samples[256]; // [2*i] = left channel of note i, [2*i+1] = right channel of note i
+	GenZone *gen_zones; // points into SoundFont.gen_zones
+	Samples *zone_samples; // [i] = samples for gen_zones[i] (data is NULL if the zone isn't used)
+	u32 nzones;
+	Zone *zones;
+	u16 *zone_table; // [128*key + vel] = index into zones (see instrument_zone)
 } Instrument;
 
 typedef struct {
@@ -174,18 +222,53 @@ typedef struct {
 	u32 start;
 	u32 count;
 	u32 sample_rate;
+	u8 pitch; // original MIDI pitch
+	i8 pitch_correction; // in cents
 } SampleHdr;
 
+// sample data shared between all zones/instruments which use the same sample
+typedef struct {
+	u32 refcount;
+	u32 count; // this can be less than the sample's count if it's been trimmed
+	i16 *data; // either allocated, or pointing into SoundFont.smpl
+} CachedSamples;
+
 typedef struct {
 	FILE *fp;
 	u32 nshdrs;
 	SampleHdr *shdrs;
 	u32 nigens;
 	Generator *igens;
+	u32 ngen_zones;
+	GenZone *gen_zones; // one for each instrument bag
 	u32 ninsts;
 	Instrument *insts;
+	u32 npresets; // not including the terminal EOP preset
+	Preset *presets;
+	u32 npreset_zones;
+	PresetZone *preset_zones;
+	u32 preset_table_size; // a power of 2
+	u32 *preset_table; // hash table for find_preset. [i] = index into presets + 1, or 0 for an empty slot
 	u32 nsamples;
 	i64 sdta_offset;
+	i64 pdta_offset; // offset of the "pdta" in the pdta LIST
+	u32 pdta_size;
+	u64 pdta_hash; // FNV-1a hash of the pdta LIST (not including the LIST header)
+	// if shdrs/igens/gen_zones come from an index file, this is its mapping (see read_sound_font_index)
+	void *index_map;
+	size_t index_map_size;
+	// if the smpl chunk has been mmapped, this points to the first sample in it
+	// (see map_sound_font_samples), otherwise it's NULL.
+	i16 *smpl;
+	void *map;
+	size_t map_size;
+	CachedSamples *sample_cache; // [i] = data for shdrs[i]
+	// if not NULL, [i] = number of samples to load for shdrs[i], or 0 for all of them (see compute_sample_load_counts)
+	u32 *sample_load_counts;
+	pthread_mutex_t sample_cache_mutex; // instruments can be loaded from multiple threads at once
+	bool prefault; // touch all sample data as it's loaded (so that the sound thread doesn't page fault on it)
+	u64 sample_bytes_allocated; // bytes currently allocated for samples in sample_cache
+	u64 sample_bytes_saved; // bytes which didn't need to be loaded because they were already in sample_cache
 } SoundFont;
 
 typedef enum {
@@ -355,136 +438,493 @@ static void print_gen(Generator *gen) {
 	}
 }
 
-static void load_instrument(SoundFont *sndfont, Instrument *inst) {
-	FILE *fp = sndfont->fp;
+// called once the soundfont has been read
+static void sample_cache_init(SoundFont *sndfont) {
+	sndfont->sample_cache = calloc(sndfont->nshdrs, sizeof *sndfont->sample_cache);
+	pthread_mutex_init(&sndfont->sample_cache_mutex, NULL);
+}
+
+// get the data for shdrs[sample_id], reading it from the file if no one else is using it.
+// call sample_data_release when you're done with it.
+// *count is set to the number of samples which were loaded.
+static i16 *sample_data_acquire(SoundFont *sndfont, u16 sample_id, u32 *count) {
+	assert(sample_id < sndfont->nshdrs);
+	SampleHdr *hdr = &sndfont->shdrs[sample_id];
+	CachedSamples *cached = &sndfont->sample_cache[sample_id];
+	size_t const bytes_per_sample = sizeof *cached->data;
+	u32 load_count = hdr->count;
+	if (sndfont->sample_load_counts && sndfont->sample_load_counts[sample_id])
+		load_count = sndfont->sample_load_counts[sample_id];
+	size_t bytes = bytes_per_sample * load_count;
+	i16 *data = NULL;
+	pthread_mutex_lock(&sndfont->sample_cache_mutex);
+	if (cached->refcount > 0) {
+		++cached->refcount;
+		sndfont->sample_bytes_saved += bytes;
+		data = cached->data;
+	} else if (sndfont->smpl) {
+		// no need to copy anything, just point into the mapping
+		cached->refcount = 1;
+		cached->count = hdr->count;
+		data = cached->data = sndfont->smpl + hdr->start;
+	}
+	*count = cached->count;
+	pthread_mutex_unlock(&sndfont->sample_cache_mutex);
+	if (data) return data;
+
+	// don't hold the lock while reading, so that other threads can load other samples
+	data = calloc(1, bytes);
+	i64 offset = sndfont->sdta_offset + (i64)hdr->start * (i64)bytes_per_sample;
+	ssize_t bytes_read = pread(fileno(sndfont->fp), data, bytes, (off_t)offset);
+	if (bytes_read < 0 || (size_t)bytes_read != bytes) {
+		warn("Couldn't read samples for %s (%s).", hdr->name, bytes_read < 0 ? strerror(errno) : "file too short");
+	}
+
+	pthread_mutex_lock(&sndfont->sample_cache_mutex);
+	if (cached->refcount++ > 0) {
+		// someone else loaded it while we were
+		free(data);
+		data = cached->data;
+		sndfont->sample_bytes_saved += bytes;
+	} else {
+		cached->data = data;
+		cached->count = load_count;
+		sndfont->sample_bytes_allocated += bytes;
+	}
+	*count = cached->count;
+	pthread_mutex_unlock(&sndfont->sample_cache_mutex);
+	return data;
+}
+
+static void sample_data_release(SoundFont *sndfont, u16 sample_id) {
+	assert(sample_id < sndfont->nshdrs);
+	CachedSamples *cached = &sndfont->sample_cache[sample_id];
+	pthread_mutex_lock(&sndfont->sample_cache_mutex);
+	assert(cached->refcount > 0);
+	if (--cached->refcount == 0) {
+		if (!sndfont->smpl) {
+			free(cached->data);
+			sndfont->sample_bytes_allocated -= sizeof *cached->data * cached->count;
+		}
+		cached->data = NULL;
+	}
+	pthread_mutex_unlock(&sndfont->sample_cache_mutex);
+}
+
+enum {
+	ADDR_START,
+	ADDR_END,
+	ADDR_LOOP_START,
+	ADDR_LOOP_END
+};
+
+// generator values for an instrument zone
+typedef struct {
+	Range key, vel;
+	i32 sample_id; // -1 if there's no sample (i.e. this is the global zone)
+	i16 pan; // -500 = left, 500 = right
+	u16 root_key; // U16_MAX = use the sample's pitch
+	i16 coarse_tune; // semitones
+	i16 fine_tune; // cents
+	i16 scale_tuning; // cents per key
+	i16 attenuation; // centibels
+	u16 sample_modes; // LoopMode
+	i16 addr_offsets[4][2]; // [ADDR_xxx][0] = fine offset, [ADDR_xxx][1] = coarse offset (in units of 32768 samples)
+} ZoneGens;
+
+static void zone_gens_apply(ZoneGens *zone_gens, Generator const *gen, Generator const *end) {
+	for (; gen < end; ++gen) {
+		GenAmount amount = gen->amount;
+		//print_gen(gen);
+		switch (gen->oper) {
+		case GEN_keyRange: zone_gens->key = amount.range; break;
+		case GEN_velRange: zone_gens->vel = amount.range; break;
+		case GEN_pan: zone_gens->pan = amount.sint; break;
+		case GEN_sampleID: zone_gens->sample_id = amount.uint; break;
+		case GEN_overridingRootKey: zone_gens->root_key = amount.uint; break;
+		case GEN_coarseTune: zone_gens->coarse_tune = amount.sint; break;
+		case GEN_fineTune: zone_gens->fine_tune = amount.sint; break;
+		case GEN_scaleTuning: zone_gens->scale_tuning = amount.sint; break;
+		case GEN_initialAttenuation: zone_gens->attenuation = amount.sint; break;
+		case GEN_sampleModes: zone_gens->sample_modes = amount.uint & 3; break;
+		case GEN_startAddrsOffset: zone_gens->addr_offsets[ADDR_START][0] = amount.sint; break;
+		case GEN_startAddrsCoarseOffset: zone_gens->addr_offsets[ADDR_START][1] = amount.sint; break;
+		case GEN_endAddrsOffset: zone_gens->addr_offsets[ADDR_END][0] = amount.sint; break;
+		case GEN_endAddrsCoarseOffset: zone_gens->addr_offsets[ADDR_END][1] = amount.sint; break;
+		case GEN_startloopAddrsOffset: zone_gens->addr_offsets[ADDR_LOOP_START][0] = amount.sint; break;
+		case GEN_startloopAddrsCoarseOffset: zone_gens->addr_offsets[ADDR_LOOP_START][1] = amount.sint; break;
+		case GEN_endloopAddrsOffset: zone_gens->addr_offsets[ADDR_LOOP_END][0] = amount.sint; break;
+		case GEN_endloopAddrsCoarseOffset: zone_gens->addr_offsets[ADDR_LOOP_END][1] = amount.sint; break;
+		}
+	}
+}
+
+static inline i64 zone_gens_offset(ZoneGens const *zone_gens, int which) {
+	return (i64)zone_gens->addr_offsets[which][0] + 32768 * (i64)zone_gens->addr_offsets[which][1];
+}
+
+// works out which part of its sample a zone plays (*start and *count), and where its loop is, relative to *start
+// (which isn't necessarily a valid loop, see resolve_zone). returns false if the zone doesn't play anything.
+static bool zone_sample_range(SoundFont *sndfont, ZoneGens const *zone_gens, i64 *start, u32 *count,
+	u32 *loop_start, u32 *loop_end) {
+	SampleHdr *hdr = &sndfont->shdrs[zone_gens->sample_id];
+	i64 s = zone_gens_offset(zone_gens, ADDR_START);
+	i64 e = (i64)hdr->count + zone_gens_offset(zone_gens, ADDR_END);
+	if (s < 0) s = 0;
+	if (e > hdr->count) e = hdr->count;
+	if (s >= e) return false;
+	*start = s;
+	*count = (u32)(e - s);
+	i64 ls = (i64)hdr->start_loop - hdr->start + zone_gens_offset(zone_gens, ADDR_LOOP_START) - s;
+	i64 le = (i64)hdr->end_loop - hdr->start + zone_gens_offset(zone_gens, ADDR_LOOP_END) - s;
+	*loop_start = ls < 0 ? 0 : (u32)ls;
+	*loop_end = le < 0 ? 0 : le > *count ? *count : (u32)le;
+	return true;
+}
+
+// fills out gens[i] for each of inst's zones, and sets used[i] to whether that zone can be played.
+static void instrument_zone_gens(SoundFont *sndfont, Instrument *inst, ZoneGens *gens, bool *used) {
 	Generator *igens = sndfont->igens;
-	SampleHdr *shdrs = sndfont->shdrs;
-	GenZone *zone = inst->gen_zones;
+	GenZone *gen_zone = inst->gen_zones;
 	u32 ngen_zones = inst->ngen_zones;
+	ZoneGens global = {
+		.key = {0, 127},
+		.vel = {0, 127},
+		.sample_id = -1,
+		.root_key = U16_MAX,
+		.scale_tuning = 100,
+	};
 //	printf("-----Instrument %s has-----\n", inst->name);
-	for (u32 z = 0; z < ngen_zones; ++z, ++zone) {
+	for (u32 z = 0; z < ngen_zones; ++z, ++gen_zone) {
 //		printf("--Zone %u/%u\n", 1+(unsigned)z, (unsigned)ngen_zones);
-		u32 start = zone->start, end = zone->end;
+		used[z] = false;
+		u32 start = gen_zone->start, end = gen_zone->end;
 		assert(end <= sndfont->nigens);
-		Generator *gen = &igens[start];
-		i16 pan = 0;
-		u8 key_lo = 1;
-		u8 key_hi = 0;
-		u16 root_key = U16_MAX;
-		u16 sample_id = 0;
-		for (u32 i = start; i < end; ++i, ++gen) {
-			GenAmount amount = gen->amount;
-			//print_gen(gen);
-			switch (gen->oper) {
-			case GEN_keyRange:
-				key_lo = amount.range.lo;
-				key_hi = amount.range.hi;
-				break;
-			case GEN_pan:
-				pan = amount.sint;
-				break;
-			case GEN_sampleID:
-				sample_id = amount.uint;
-				break;
-			case GEN_overridingRootKey:
-				root_key = amount.uint;
-			}
+		ZoneGens zone_gens = global;
+		zone_gens_apply(&zone_gens, &igens[start], &igens[end]);
+		if (zone_gens.sample_id < 0) {
+			// the first zone can be a global zone, with defaults for the other zones
+			if (z == 0) global = zone_gens;
+			continue;
 		}
 
 		// i dunno what this generator's doing
-		if (key_lo > key_hi) 
+		if (zone_gens.key.lo > zone_gens.key.hi || zone_gens.vel.lo > zone_gens.vel.hi
+			|| zone_gens.key.lo > 127 || zone_gens.vel.lo > 127)
 			continue;
+		if (zone_gens.key.hi > 127) zone_gens.key.hi = 127;
+		if (zone_gens.vel.hi > 127) zone_gens.vel.hi = 127;
 
-		if (root_key == U16_MAX) {
-			warn("Root key not specified. Not using this sample.");
+		if ((u32)zone_gens.sample_id + 1 >= sndfont->nshdrs) {
+			warn("Zone refers to sample %ld, but there are only %lu.", (long)zone_gens.sample_id,
+				(unsigned long)sndfont->nshdrs - 1);
 			continue;
 		}
-		
-		assert(sample_id < sndfont->nshdrs);
-		SampleHdr *hdr = &shdrs[sample_id];
-		Samples *samples = NULL;
-		size_t const bytes_per_sample = sizeof *samples->data;
-		u32 nsamples = hdr->count;
-		size_t bytes = bytes_per_sample * nsamples;
-		samples = calloc(1, sizeof *samples + bytes);
-		samples->pitch = (u8)root_key;
-		samples->sample_rate = hdr->sample_rate;
-		samples->count = nsamples;
-		{
-			u32 start_sample = hdr->start;
-			fseek(fp, sndfont->sdta_offset, SEEK_SET);
-			fseek(fp, (long)start_sample * (long)bytes_per_sample, SEEK_CUR);
-			fread(samples->data, bytes_per_sample, nsamples, fp);
-		}
-
-		//printf("%u used for %u-%u\n", samples->pitch, key_lo, key_hi);
-		if (pan <= 0) {
-			for (u8 k = key_lo; k <= key_hi; ++k) {
-				inst->samples[2*k] = samples;
+		gens[z] = zone_gens;
+		used[z] = true;
+	}
+}
+
+/*
+	Works out how much of each sample actually needs to be loaded.
+	If trim_loops is set and a sample is only ever used with LOOP_CONTINUOUS, nothing after
+	the end of its loop will ever be played, so there's no need to load it.
+	If stream_head_ms is nonzero, only the first stream_head_ms milliseconds of samples which
+	are never looped are loaded, and the rest is streamed while they're played.
+*/
+static void compute_sample_load_counts(SoundFont *sndfont, bool trim_loops, u32 stream_head_ms) {
+	u32 nshdrs = sndfont->nshdrs;
+	u32 *load_counts = calloc(nshdrs, sizeof *load_counts);
+	bool *untrimmable = calloc(nshdrs, sizeof *untrimmable);
+	bool *looped = calloc(nshdrs, sizeof *looped);
+	for (u32 i = 0; i + 1 < sndfont->ninsts; ++i) {
+		Instrument *inst = &sndfont->insts[i];
+		u32 ngen_zones = inst->ngen_zones;
+		ZoneGens *gens = calloc(ngen_zones, sizeof *gens);
+		bool *used = calloc(ngen_zones, sizeof *used);
+		instrument_zone_gens(sndfont, inst, gens, used);
+		for (u32 z = 0; z < ngen_zones; ++z) {
+			if (!used[z]) continue;
+			u32 sample_id = (u32)gens[z].sample_id;
+			SampleHdr *hdr = &sndfont->shdrs[sample_id];
+			i64 start = 0;
+			u32 count = 0, loop_start = 0, loop_end = 0;
+			if (!zone_sample_range(sndfont, &gens[z], &start, &count, &loop_start, &loop_end)) continue;
+			// this zone's samples are played with the loop mode and loop points of the left channel's zone
+			// (see resolve_zone), which is either this zone, or (if this can be a right channel) any zone which
+			// can be a left channel for some of the same notes.
+			for (u32 l = 0; l < ngen_zones; ++l) {
+				ZoneGens const *g = &gens[l], *gz = &gens[z];
+				if (l != z && !(used[l] && gz->pan >= 0 && g->pan <= 0
+					&& g->key.lo <= gz->key.hi && gz->key.lo <= g->key.hi
+					&& g->vel.lo <= gz->vel.hi && gz->vel.lo <= g->vel.hi))
+					continue;
+				i64 l_start = 0;
+				u32 l_count = 0, l_loop_start = 0, l_loop_end = 0;
+				if (!zone_sample_range(sndfont, g, &l_start, &l_count, &l_loop_start, &l_loop_end)) continue;
+				if (g->sample_modes == LOOP_CONTINUOUS || g->sample_modes == LOOP_UNTIL_RELEASE)
+					looped[sample_id] = true;
+				// only trim samples which are always played as a continuous loop (with valid loop points, so that
+				// resolve_zone doesn't turn the loop off), and never past the end of the loop
+				i64 needed = start + (i64)l_loop_end + LOOP_GUARD;
+				if (g->sample_modes != LOOP_CONTINUOUS || !(l_loop_start < l_loop_end && l_loop_end <= l_count)
+					|| needed >= hdr->count) {
+					untrimmable[sample_id] = true;
+				} else if ((u32)needed > load_counts[sample_id]) {
+					load_counts[sample_id] = (u32)needed;
+				}
 			}
 		}
-		if (pan >= 0) {
-			for (u8 k = key_lo; k <= key_hi; ++k) {
-				inst->samples[2*k+1] = samples;
-			}
+		free(gens);
+		free(used);
+	}
+	u64 bytes_trimmed = 0, bytes_streamed = 0;
+	for (u32 i = 0; i < nshdrs; ++i) {
+		SampleHdr *hdr = &sndfont->shdrs[i];
+		if (!trim_loops || untrimmable[i]) load_counts[i] = 0;
+		if (load_counts[i]) bytes_trimmed += (u64)(hdr->count - load_counts[i]) * sizeof(i16);
+		u64 head = (u64)hdr->sample_rate * stream_head_ms / 1000;
+		if (stream_head_ms && !looped[i] && head < hdr->count) {
+			load_counts[i] = (u32)head;
+			bytes_streamed += (u64)(hdr->count - head) * sizeof(i16);
 		}
 	}
+	free(untrimmable);
+	free(looped);
+	sndfont->sample_load_counts = load_counts;
+	if (trim_loops)
+		printf("Trimming looped samples will save up to %.1f MB.\n", (double)bytes_trimmed / (1024.0 * 1024.0));
+	if (stream_head_ms)
+		printf("Streaming %.1f MB of samples from disk.\n", (double)bytes_streamed / (1024.0 * 1024.0));
+}
 
-	// at this point, there could be gaps in the samples, so we can fill them in nearby notes
+// turns a pair of instrument zones (which can be the same zone) into a Zone
+static void resolve_zone(SoundFont *sndfont, Instrument *inst, ZoneGens const *gens, u32 zl, u32 zr, Zone *zone) {
+	ZoneGens const *gl = &gens[zl], *gr = &gens[zr];
+	Samples *samples_L = &inst->zone_samples[zl], *samples_R = &inst->zone_samples[zr];
+	if (samples_L->sample_rate != samples_R->sample_rate) {
+		warn("Sample rate mismatch in soundfont between left and right channels. Using left.");
+		samples_R = samples_L;
+	} else if (samples_L->count != samples_R->count) {
+		warn("Sample count for left channel doesn't match sample count for right channel. Using left.");
+		samples_R = samples_L;
+	}
+	zone->samples_L = samples_L;
+	zone->samples_R = samples_R;
+	zone->loop_mode = (LoopMode)gl->sample_modes;
+	if (zone->loop_mode != LOOP_CONTINUOUS && zone->loop_mode != LOOP_UNTIL_RELEASE)
+		zone->loop_mode = LOOP_NONE;
+	if (!(samples_L->loop_start < samples_L->loop_end && samples_L->loop_end <= samples_L->count))
+		zone->loop_mode = LOOP_NONE; // bad loop points
 
-	Samples *first_nonnull_L = NULL, *first_nonnull_R = NULL;
-	for (int i = 0; i < 256; i += 2) {
-		// fix it if there's one channel for a note, but not the other
-		if (inst->samples[i] && !inst->samples[i+1]) {
-			warn("Missing right channel for note %d. Using left.", i);
-			inst->samples[i+1] = inst->samples[i];
-		}
-		if (!inst->samples[i] && inst->samples[i+1]) {
-			warn("Missing left channel for note %d. Using right.", i);
-			inst->samples[i] = inst->samples[i+1];
+	SampleHdr *hdr = &sndfont->shdrs[gl->sample_id];
+	u16 root_key = gl->root_key != U16_MAX ? gl->root_key : hdr->pitch;
+	if (root_key > 127) root_key = 60; // 255 means unpitched
+	zone->root_key = (u8)root_key;
+	zone->tuning = 100 * (i32)gl->coarse_tune + gl->fine_tune + hdr->pitch_correction;
+	zone->scale_tuning = gl->scale_tuning;
+	zone->gain_L = powf(10.0f, -(float)gl->attenuation / 200.0f);
+	zone->gain_R = powf(10.0f, -(float)gr->attenuation / 200.0f);
+	if (zl == zr) {
+		// a mono sample, so pan it
+		float pan = (float)gl->pan / 500.0f;
+		if (pan < -1.0f) pan = -1.0f;
+		if (pan > +1.0f) pan = +1.0f;
+		if (pan > 0.0f) zone->gain_L *= 1.0f - pan;
+		if (pan < 0.0f) zone->gain_R *= 1.0f + pan;
+	}
+}
+
+static void load_instrument(SoundFont *sndfont, Instrument *inst) {
+	u32 ngen_zones = inst->ngen_zones;
+	if (inst->zone_samples) return; // already loaded
+	inst->zone_samples = calloc(ngen_zones, sizeof *inst->zone_samples);
+	ZoneGens *gens = calloc(ngen_zones, sizeof *gens);
+	bool *zone_used = calloc(ngen_zones, sizeof *zone_used);
+	instrument_zone_gens(sndfont, inst, gens, zone_used);
+	for (u32 z = 0; z < ngen_zones; ++z) {
+		if (!zone_used[z]) continue;
+		ZoneGens *zone_gens = &gens[z];
+		u16 sample_id = (u16)zone_gens->sample_id;
+		SampleHdr *hdr = &sndfont->shdrs[sample_id];
+		i64 start = 0;
+		u32 count = 0, loop_start = 0, loop_end = 0;
+		if (!zone_sample_range(sndfont, zone_gens, &start, &count, &loop_start, &loop_end)) {
+			zone_used[z] = false;
+			continue;
 		}
+		Samples *samples = &inst->zone_samples[z];
+		u32 loaded_count = 0;
+		i16 *data = sample_data_acquire(sndfont, sample_id, &loaded_count);
+		samples->data = data + start;
+		samples->sample_id = sample_id;
+		samples->sample_rate = hdr->sample_rate;
+		samples->count = count;
+		// the rest of the sample was trimmed or needs to be streamed
+		samples->resident = loaded_count > start ? (u32)(loaded_count - start) : 0;
+		if (samples->resident > samples->count) samples->resident = samples->count;
+		samples->file_offset = sndfont->sdta_offset + ((i64)hdr->start + start) * (i64)sizeof(i16);
+		samples->loop_start = loop_start;
+		samples->loop_end = loop_end;
+		if (sndfont->prefault)
+			prefault(samples->data, samples->resident * sizeof *samples->data);
+	}
+
+	// work out which zones to use for each key/velocity.
+	// each distinct (left zone, right zone) pair gets one entry in inst->zones.
+	u16 *zone_table = malloc(128 * 128 * sizeof *zone_table);
+	u32 *zone_pairs = NULL; // [2*i], [2*i+1] = left, right instrument zone for inst->zones[i]
+	Zone *zones = NULL;
+	u32 nzones = 0, zones_capacity = 0;
+	bool missing_channel = false;
+	for (u32 key = 0; key < 128; ++key) {
+		for (u32 vel = 0; vel < 128; ++vel) {
+			u16 *cell = &zone_table[128 * key + vel];
+			*cell = NO_ZONE;
+			i64 zl = -1, zr = -1;
+			for (u32 z = 0; z < ngen_zones; ++z) {
+				if (!zone_used[z]) continue;
+				ZoneGens *g = &gens[z];
+				if (key < g->key.lo || key > g->key.hi || vel < g->vel.lo || vel > g->vel.hi)
+					continue;
+				if (g->pan <= 0) zl = z;
+				if (g->pan >= 0) zr = z;
+			}
+			if (zl < 0 && zr < 0) continue;
+			// fix it if there's one channel for a note, but not the other
+			if (zl < 0 || zr < 0) missing_channel = true;
+			if (zl < 0) zl = zr;
+			if (zr < 0) zr = zl;
 
-		if (!first_nonnull_L && inst->samples[i]) {
-			first_nonnull_L = inst->samples[i];
-			first_nonnull_R = inst->samples[i+1];
+			u32 i;
+			for (i = 0; i < nzones; ++i) {
+				if (zone_pairs[2*i] == (u32)zl && zone_pairs[2*i+1] == (u32)zr)
+					break;
+			}
+			if (i == nzones) {
+				if (nzones == zones_capacity) {
+					zones_capacity = zones_capacity ? 2 * zones_capacity : 8;
+					zones = realloc(zones, zones_capacity * sizeof *zones);
+					zone_pairs = realloc(zone_pairs, 2 * zones_capacity * sizeof *zone_pairs);
+				}
+				zone_pairs[2*i] = (u32)zl;
+				zone_pairs[2*i+1] = (u32)zr;
+				resolve_zone(sndfont, inst, gens, (u32)zl, (u32)zr, &zones[i]);
+				++nzones;
+			}
+			*cell = (u16)i;
 		}
 	}
+	free(zone_pairs);
+	free(zone_used);
+	free(gens);
+	if (missing_channel) {
+		warn("Instrument %s is missing a left or right channel for some notes. Using the other one.", inst->name);
+	}
 
-	if (!first_nonnull_L) {
+	inst->zones = zones;
+	inst->nzones = nzones;
+	inst->zone_table = zone_table;
+	if (nzones == 0) {
 		warn("No samples for instrument %s.", inst->name);
 		return;
 	}
+	assert(nzones < NO_ZONE);
 
-	Samples *last_sample_L = first_nonnull_L, *last_sample_R = first_nonnull_R;
-
-	for (int i = 0; i < 256; i += 2) {	
-		if (!inst->samples[i]) {
-			inst->samples[i] = last_sample_L;
-			inst->samples[i+1] = last_sample_R;
-		} else {
-			last_sample_L = inst->samples[i];
-			last_sample_R = inst->samples[i+1];
+	// at this point, there could be gaps in the table, so we can fill them in with nearby velocities/notes
+	i32 first_key = -1;
+	for (u32 key = 0; key < 128; ++key) {
+		u16 *column = &zone_table[128 * key];
+		u16 first = NO_ZONE;
+		for (u32 vel = 0; vel < 128 && first == NO_ZONE; ++vel)
+			first = column[vel];
+		if (first == NO_ZONE) continue;
+		if (first_key < 0) first_key = (i32)key;
+		u16 last = first;
+		for (u32 vel = 0; vel < 128; ++vel) {
+			if (column[vel] == NO_ZONE)
+				column[vel] = last;
+			else
+				last = column[vel];
 		}
 	}
-
-	for (int i = 0; i < 256; i += 2) {
-		assert(inst->samples[i] && inst->samples[i+1]);
-		if (inst->samples[i]->sample_rate != inst->samples[i+1]->sample_rate) {
-			warn("Sample rate mismatch in soundfont between left and right channels. Using left.");
-			inst->samples[i+1] = inst->samples[i];
-		}
+	assert(first_key >= 0);
+	u16 *last_column = &zone_table[128 * first_key];
+	for (u32 key = 0; key < 128; ++key) {
+		u16 *column = &zone_table[128 * key];
+		if (column[0] == NO_ZONE)
+			memcpy(column, last_column, 128 * sizeof *column);
+		else
+			last_column = column;
 	}
 	inst->samples_loaded = true;
 }
 
+static void unload_instrument(SoundFont *sndfont, Instrument *inst) {
+	if (!inst->zone_samples) return;
+	for (u32 z = 0; z < inst->ngen_zones; ++z) {
+		Samples *samples = &inst->zone_samples[z];
+		if (samples->data)
+			sample_data_release(sndfont, samples->sample_id);
+	}
+	free(inst->zone_samples);
+	free(inst->zones);
+	free(inst->zone_table);
+	inst->zone_samples = NULL;
+	inst->zones = NULL;
+	inst->zone_table = NULL;
+	inst->nzones = 0;
+	inst->samples_loaded = false;
+}
+
+// which zone should be used for this note? only call this if inst->samples_loaded.
+static inline Zone *instrument_zone(Instrument *inst, u8 key, u8 vel) {
+	assert(key < 128 && vel < 128);
+	return &inst->zones[inst->zone_table[128 * key + vel]];
+}
+
+// [c] = 2^(c / 1200) in 1.31 fixed point, so that pitch calculations don't need any transcendental functions
+static u32 cent_ratios[1200];
+
+static void pitch_init(void) {
+	for (u32 c = 0; c < 1200; ++c)
+		cent_ratios[c] = (u32)llround(ldexp(pow(2.0, c / 1200.0), 31));
+}
+
+// how far from the samples' original pitch (in cents) key is
+static inline i32 zone_key_cents(Zone const *zone, u8 key) {
+	return ((i32)key - zone->root_key) * zone->scale_tuning + zone->tuning;
+}
+
+// anything more than 256 times the original speed is silly
+#define MAX_PHASE_INCREMENT ((u64)256 << 32)
+
+/*
+	How much to advance a 32.32 fixed-point position in the samples for each output frame,
+	to play samples recorded at sample_rate, shifted by cents, at output_rate.
+*/
+static u64 phase_increment(u32 sample_rate, u32 output_rate, i32 cents) {
+	i32 octaves = cents >= 0 ? cents / 1200 : -((1199 - cents) / 1200);
+	u32 ratio = cent_ratios[cents - octaves * 1200];
+	u64 base = ((u64)sample_rate << 32) / output_rate;
+	// (base * ratio) >> 31 without overflowing
+	u64 inc = (((base >> 32) * ratio) << 1) + (((base & 0xffffffff) * ratio) >> 31);
+	if (octaves >= 0)
+		inc = octaves >= 8 ? MAX_PHASE_INCREMENT : inc << octaves;
+	else
+		inc = octaves < -63 ? 0 : inc >> -octaves;
+	if (inc > MAX_PHASE_INCREMENT) inc = MAX_PHASE_INCREMENT;
+	return inc ? inc : 1;
+}
+
 
 // for testing, doesn't do stereo
-static void write_samples(FILE *file, u32 target_sample_rate, Samples *samples, u8 pitch, u8 vel) {
+static void write_samples(FILE *file, u32 target_sample_rate, Zone *zone, u8 pitch, u8 vel) {
 	assert(pitch < 128 && vel < 128);
+	Samples *samples = zone->samples_L;
 	u32 playback_sample_rate = samples->sample_rate;
-	u32 count = samples->count;
-	int pitch_diff = pitch - samples->pitch;
-	double sample_rate_multiplier = pow(2.0, pitch_diff / 12.0);
+	u32 count = samples->resident;
+	double sample_rate_multiplier = pow(2.0, zone_key_cents(zone, pitch) / 1200.0);
 	playback_sample_rate = (u32)(playback_sample_rate * sample_rate_multiplier);
 	i16 *data = samples->data;
 	for (u32 i = 0; ; ++i) {
@@ -497,318 +937,413 @@ static void write_samples(FILE *file, u32 target_sample_rate, Samples *samples,
 
 // for testing, doesn't do stereo
 static inline void write_note(FILE *file, u32 sample_rate, Instrument *instrument, u8 pitch, u8 vel) {
-	write_samples(file, sample_rate, instrument->samples[pitch * 2], pitch, vel);
+	write_samples(file, sample_rate, instrument_zone(instrument, pitch, vel), pitch, vel);
+}
+
+static u64 fnv1a64_update(u64 hash, void const *data, size_t len) {
+	u8 const *p = data;
+	for (size_t i = 0; i < len; ++i) {
+		hash ^= p[i];
+		hash *= 0x100000001b3;
+	}
+	return hash;
+}
+
+static u64 fnv1a64(void const *data, size_t len) {
+	return fnv1a64_update(0xcbf29ce484222325, data, len);
+}
+
+// a RIFF chunk which has been read into memory
+typedef struct {
+	u8 const *data;
+	u32 size;
+	u32 pos; // for reading sub-chunks/fields
+} Chunk;
+
+// all the chunk_ functions assume the soundfont file is little-endian, like the rest of smidi
+static inline u8 chunk_u8(Chunk *chunk) {
+	assert(chunk->pos + 1 <= chunk->size);
+	return chunk->data[chunk->pos++];
+}
+static inline i8 chunk_i8(Chunk *chunk) {
+	return (i8)chunk_u8(chunk);
+}
+static inline u16 chunk_u16(Chunk *chunk) {
+	assert(chunk->pos + 2 <= chunk->size);
+	u16 x;
+	memcpy(&x, chunk->data + chunk->pos, sizeof x);
+	chunk->pos += 2;
+	return x;
+}
+static inline u32 chunk_u32(Chunk *chunk) {
+	assert(chunk->pos + 4 <= chunk->size);
+	u32 x;
+	memcpy(&x, chunk->data + chunk->pos, sizeof x);
+	chunk->pos += 4;
+	return x;
+}
+static inline void chunk_bytes(Chunk *chunk, void *out, u32 n) {
+	assert(chunk->pos + n <= chunk->size);
+	memcpy(out, chunk->data + chunk->pos, n);
+	chunk->pos += n;
+}
+
+// reads the next sub-chunk of list into sub. returns false if there are no more.
+static bool chunk_next(Chunk *list, char id[5], Chunk *sub) {
+	if (list->size - list->pos < 8) return false;
+	chunk_bytes(list, id, 4);
+	id[4] = '\0';
+	u32 size = chunk_u32(list);
+	if (size > list->size - list->pos) {
+		die("Invalid soundfont file: %s chunk is too big (%lu bytes, but there are only %lu left).",
+			id, (unsigned long)size, (unsigned long)(list->size - list->pos));
+	}
+	sub->data = list->data + list->pos;
+	sub->size = size;
+	sub->pos = 0;
+	list->pos += size + (size & 1); // chunks are padded to an even size
+	if (list->pos > list->size) list->pos = list->size;
+	return true;
+}
+
+// reads the next sub-chunk of list, which must be called id, and must consist of records of size record_size.
+// returns the number of records.
+static u32 chunk_expect(Chunk *list, char const *id, u32 record_size, Chunk *sub) {
+	char sub_id[5];
+	if (!chunk_next(list, sub_id, sub) || strcmp(sub_id, id) != 0) {
+		die("Invalid soundfont file: no %s.", id);
+	}
+	if (sub->size % record_size != 0) {
+		die("Invalid soundfont file: %s size is not a multiple of %lu.", id, (unsigned long)record_size);
+	}
+	return sub->size / record_size;
+}
+
+// reads a LIST chunk header from fp. returns the list's size (including the type).
+static u32 read_list_header(FILE *fp, char const *type) {
+	u8 hdr[12];
+	if (fread(hdr, 1, sizeof hdr, fp) != sizeof hdr || memcmp(hdr, "LIST", 4) != 0) {
+		die("Invalid soundfont file: no %s LIST.", type);
+	}
+	if (memcmp(hdr + 8, type, 4) != 0) {
+		die("Invalid soundfont file: no %s.", type);
+	}
+	u32 size;
+	memcpy(&size, hdr + 4, sizeof size);
+	if (size < 4) {
+		die("Invalid soundfont file: %s LIST is too small.", type);
+	}
+	return size;
+}
+
+// reads the rest of a LIST chunk (after the header) into memory
+static Chunk read_list(FILE *fp, char const *type, u32 size) {
+	u8 *data = malloc(size);
+	if (fread(data, 1, size, fp) != size) {
+		die("Invalid soundfont file: %s LIST is cut off.", type);
+	}
+	Chunk chunk = {data, size, 0};
+	return chunk;
+}
+
+static u32 preset_hash(u16 bank, u16 program) {
+	return ((u32)bank << 7 | program) * 2654435761u;
+}
+
+static void build_preset_table(SoundFont *sound_font) {
+	u32 size = 16;
+	while (size < 2 * sound_font->npresets) size *= 2;
+	u32 *table = calloc(size, sizeof *table);
+	for (u32 i = 0; i < sound_font->npresets; ++i) {
+		Preset *preset = &sound_font->presets[i];
+		for (u32 slot = preset_hash(preset->bank, preset->preset) & (size - 1); ; slot = (slot + 1) & (size - 1)) {
+			if (!table[slot]) {
+				table[slot] = i + 1;
+				break;
+			}
+			Preset *other = &sound_font->presets[table[slot] - 1];
+			if (other->bank == preset->bank && other->preset == preset->preset)
+				break; // duplicate, keep the first one
+		}
+	}
+	sound_font->preset_table = table;
+	sound_font->preset_table_size = size;
+}
+
+// returns NULL if there's no such preset
+static Preset *find_preset(SoundFont *sound_font, u16 bank, u16 program) {
+	u32 mask = sound_font->preset_table_size - 1;
+	for (u32 slot = preset_hash(bank, program) & mask; ; slot = (slot + 1) & mask) {
+		u32 entry = sound_font->preset_table[slot];
+		if (!entry) return NULL;
+		Preset *preset = &sound_font->presets[entry - 1];
+		if (preset->bank == bank && preset->preset == program)
+			return preset;
+	}
+}
+
+// which instrument should play this note? (NULL if none)
+static Instrument *preset_instrument(SoundFont *sound_font, Preset *preset, u8 key, u8 vel) {
+	PresetZone *zone = &sound_font->preset_zones[preset->first_zone];
+	for (u32 i = 0; i < preset->nzones; ++i, ++zone) {
+		if (key >= zone->key_lo && key <= zone->key_hi && vel >= zone->vel_lo && vel <= zone->vel_hi)
+			return &sound_font->insts[zone->inst];
+	}
+	return NULL;
 }
 
 static void read_sound_font(FILE *fp, SoundFont *sound_font, bool verbose) {
 	sound_font->fp = fp;
 	// RIFF chunk
-	char riff[5] = {0};
-	fread(riff, 1, 4, fp);
-	if (strncmp(riff, "RIFF", 4) != 0) {
+	u8 riff[12];
+	if (fread(riff, 1, sizeof riff, fp) != sizeof riff || memcmp(riff, "RIFF", 4) != 0) {
 		die("invalid soundfont file: no RIFF.");
 	}
-	u32 riff_size = read_u32(fp);
-	(void)riff_size;
-	// sbfk chunk
-	char sbfk[5] = {0};
-	fread(sbfk, 1, 4, fp);
-	if (strncmp(sbfk, "sfbk", 4) != 0) {
+	if (memcmp(riff + 8, "sfbk", 4) != 0) {
 		die("invalid soundfont file: no sfbk.");
 	}
+
 	// info LIST chunk
-	char info_list[5] = {0};
-	fread(info_list, 1, 4, fp);
-	if (strncmp(info_list, "LIST", 4) != 0) {
-		die("invalid soundfont file: no LIST.");
-	}
-	u32 info_size = read_u32(fp);
-	long info_list_start = ftell(fp);
-	char info[5] = {0};
-	fread(info, 1, 4, fp);
-	if (strncmp(info, "INFO", 4) != 0) {
-		die("invalid soundfont file: no INFO.");
-	}
-	char ifil[5] = {0};
-	fread(ifil, 1, 4, fp);
-	if (strncmp(ifil, "ifil", 4) != 0) {
-		die("invalid soundfont file: no ifil.");
-	}
-	u32 ifil_size = read_u32(fp);
-	if (ifil_size != 4) {
-		die("invalid soundfont file: wrong ifil size.");
-	}
-	u16 vmajor = read_u16(fp);
-	u16 vminor = read_u16(fp);
-
-	if (verbose) printf("SoundFont version %u.%u\n", vmajor, vminor);
-	if (vmajor != 2) {
-		warn("SoundFont is not version 2, but version %u.", vmajor);
-	}
-	char isng[5] = {0};
-	fread(isng, 1, 4, fp);
-	if (strncmp(isng, "isng", 4) != 0) {
-		die("invalid soundfont file: no isng.");
-	}
-	u32 isng_size = read_u32(fp);
-	
-	{
-		char *sng = calloc(1, isng_size);
-		fread(sng, 1, isng_size, fp);
-		if (verbose) printf("Optimized for %s.\n", sng);
-		free(sng);
-	}
-	char inam[5] = {0};
-	fread(inam, 1, 4, fp);
-	if (strncmp(inam, "INAM", 4) != 0) {
-		die("invalid soundfont file: no INAM.");
-	}
-	u32 inam_size = read_u32(fp);
+	u32 info_size = read_list_header(fp, "INFO");
 	{
-		char *nam = calloc(1, inam_size);
-		fread(nam, 1, inam_size, fp);
-		if (verbose) printf("Sound bank: %s.\n", nam);
-		free(nam);
+		Chunk info = read_list(fp, "INFO", info_size - 4);
+		Chunk sub = {0};
+		char id[5];
+		bool have_ifil = false;
+		while (chunk_next(&info, id, &sub)) {
+			if (strcmp(id, "ifil") == 0) {
+				if (sub.size != 4) {
+					die("invalid soundfont file: wrong ifil size.");
+				}
+				u16 vmajor = chunk_u16(&sub);
+				u16 vminor = chunk_u16(&sub);
+				if (verbose) printf("SoundFont version %u.%u\n", vmajor, vminor);
+				if (vmajor != 2) {
+					warn("SoundFont is not version 2, but version %u.", vmajor);
+				}
+				have_ifil = true;
+			} else if (strcmp(id, "isng") == 0) {
+				if (verbose) printf("Optimized for %.*s.\n", (int)sub.size, (char const *)sub.data);
+			} else if (strcmp(id, "INAM") == 0) {
+				if (verbose) printf("Sound bank: %.*s.\n", (int)sub.size, (char const *)sub.data);
+			}
+			// skip optional info
+		}
+		if (!have_ifil) {
+			die("invalid soundfont file: no ifil.");
+		}
+		free((void *)info.data);
 	}
 
-	// skip optional info
-	fseek(fp, info_list_start + (long)info_size, SEEK_SET);
-	char sdta_list[5] = {0};
-	fread(sdta_list, 1, 4, fp);
-	if (strncmp(sdta_list, "LIST", 4) != 0) {
-		die("invalid soundfont file: no sdta list.");
-	}
-	u32 sdta_size = read_u32(fp);
-	long sdta_list_start = ftell(fp);
+	u32 sdta_size = read_list_header(fp, "sdta");
+	i64 sdta_list_start = ftello(fp) - 4;
 
-	char sdta[5] = {0};
-	fread(sdta, 1, 4, fp);
-	if (strncmp(sdta, "sdta", 4) != 0) {
-		die("Invalid soundfont file: no sdta.");
-	}
-	
 	// 16-bit samples
-	char smpl[5] = {0};
-	fread(smpl, 1, 4, fp);
-	if (strncmp(smpl, "smpl", 4) != 0) {
+	u8 smpl[8];
+	if (fread(smpl, 1, sizeof smpl, fp) != sizeof smpl || memcmp(smpl, "smpl", 4) != 0) {
 		die("Invalid soundfont file: no smpl.");
 	}
 
-	u32 smpl_size = read_u32(fp);
+	u32 smpl_size;
+	memcpy(&smpl_size, smpl + 4, sizeof smpl_size);
 	u32 bytes_per_sample = 2;
 	u32 nsamples = smpl_size / bytes_per_sample;
 	sound_font->nsamples = nsamples;
-	sound_font->sdta_offset = ftell(fp);
+	sound_font->sdta_offset = ftello(fp);
 	// these files are big, don't read it into memory until necessary
-	fseek(fp, (long)smpl_size + ftell(fp), SEEK_SET);
-	#if 0
-	i16 *samples = malloc(smpl_size);
-	if (verbose) printf("Reading 16-bit samples.\n");
-	fread(samples, bytes_per_sample, nsamples, fp);
-	#endif
+	// (could read 24-bit samples)
+	i64 sdta_list_end = sdta_list_start + (i64)sdta_size;
+	fseeko(fp, sdta_list_end, SEEK_SET);
 
-	long sdta_list_end = sdta_list_start + (long)sdta_size;
-	// could read 24-bit samples
-	fseek(fp, sdta_list_end, SEEK_SET);
-
-	char pdta_list[5] = {0};
-	fread(pdta_list, 1, 4, fp);
-	if (strncmp(pdta_list, "LIST", 4) != 0) {
-		die("Invalid soundfont file: no pdta LIST.");
-	}
-	u32 pdta_size = read_u32(fp);
-	(void)pdta_size;
-	char pdta[5] = {0};
-	fread(pdta, 1, 4, fp);
-	if (strncmp(pdta, "pdta", 4) != 0) {
-		die("Invalid soundfont file: no pdta.");
+	// read all of pdta in one go. it's not very big.
+	u32 pdta_size = read_list_header(fp, "pdta");
+	sound_font->pdta_offset = ftello(fp) - 4;
+	sound_font->pdta_size = pdta_size;
+	Chunk pdta = read_list(fp, "pdta", pdta_size - 4);
+	{
+		// the hash covers the whole LIST, including the type
+		u64 hash = fnv1a64_update(0xcbf29ce484222325, "pdta", 4);
+		sound_font->pdta_hash = fnv1a64_update(hash, pdta.data, pdta.size);
 	}
-	
+
 	// phdr chunk
-	char phdr[5] = {0};
-	fread(phdr, 1, 4, fp);
-	if (strncmp(phdr, "phdr", 4) != 0) {
-		die("Invalid soundfont file: no phdr.");
-	}
-	u32 phdr_size = read_u32(fp);
-	if (phdr_size % 38 != 0) {
-		die("Invalid soundfont file: phdr size is not a multiple of 38.");
+	Chunk phdr;
+	u32 npresets = chunk_expect(&pdta, "phdr", 38, &phdr);
+	if (npresets < 1) {
+		die("Invalid soundfont file: no presets (not even the terminal one).");
 	}
-	u32 npresets = phdr_size / 38;
 	Preset *presets = calloc(npresets, sizeof *presets);
+	u16 *preset_bags = calloc(npresets, sizeof *preset_bags);
 	Preset *preset = presets;
 	for (u32 i = 0; i < npresets; ++i, ++preset) {
-		fread(preset->name, 1, 20, fp);
-		preset->preset = read_u16(fp);
-		preset->bank = read_u16(fp);
-		preset->bag_ndx = read_u16(fp);
-		preset->library = read_u32(fp);
-		preset->genre = read_u32(fp);
-		preset->morphology = read_u32(fp);
+		chunk_bytes(&phdr, preset->name, 20);
+		preset->preset = chunk_u16(&phdr);
+		preset->bank = chunk_u16(&phdr);
+		preset_bags[i] = chunk_u16(&phdr);
+		u32 library = chunk_u32(&phdr);
+		u32 genre = chunk_u32(&phdr);
+		u32 morphology = chunk_u32(&phdr);
+		(void)library; (void)genre; (void)morphology;
+		if (i > 0 && preset_bags[i] < preset_bags[i-1]) {
+			die("Invalid soundfont file: preset bag indices aren't increasing.");
+		}
 	#if 0
 		if (verbose) {
 			printf("---Preset %u/%u: %s---\n", (unsigned)i + 1, (unsigned)npresets, preset->name);	
 			printf("Preset - %u\n", preset->preset);
 			printf("Bank - %u\n", preset->bank);
-			printf("Preset bag ndx - %u\n", preset->bag_ndx);
-			printf("Library - %u\n", (unsigned)preset->library);
-			printf("Genre - %u\n", (unsigned)preset->genre);
-			printf("Morphology - %u\n", (unsigned)preset->morphology);
+			printf("Preset bag ndx - %u\n", preset_bags[i]);
+			printf("Library - %u\n", (unsigned)library);
+			printf("Genre - %u\n", (unsigned)genre);
+			printf("Morphology - %u\n", (unsigned)morphology);
 		}
 	#endif
 	}
 
 	// pbag chunk
-	char pbag[5] = {0};
-	fread(pbag, 1, 4, fp);
-	if (strncmp(pbag, "pbag", 4) != 0) {
-		die("Invalid soundfont file: no pbag.");
-	}
-	u32 pbag_size = read_u32(fp);
-	fseek(fp, (long)pbag_size + ftell(fp), SEEK_SET);
-#if 0
-	(void)pbag_size;
-	long pbag_start = ftell(fp);
-	preset = presets;
-	for (u32 i = 0; i < npresets-1 /* -1 for terminating preset */; ++i, ++preset) {
-		preset->nbags = (u32)(preset[1].bag_ndx - preset->bag_ndx);
-		preset->bags = calloc(preset->nbags, sizeof *preset->bags);
-		PresetBag *bag = preset->bags;
-		for (u32 j = 0; j < preset->nbags; ++j, ++bag) {
-			bag->gen_ndx = read_u16(fp);
-			bag->mod_ndx = read_u16(fp);
-		#if 0
-			if (verbose) printf("Bag for %s: Gen - %u Mod - %u\n", preset->name, bag->gen_ndx, bag->mod_ndx);
-		#endif
-		}
-	}
-	read_u32(fp); // terminating pbag
-
-	if (pbag_start + (long)pbag_size != ftell(fp)) {
-		warn("Wrong pbag size.");
-		fseek(fp, pbag_start + (long)pbag_size, SEEK_SET);
+	Chunk pbag;
+	u32 npbags = chunk_expect(&pdta, "pbag", 4, &pbag);
+	if ((u32)preset_bags[npresets-1] + 1 /* terminating */ > npbags) {
+		die("Invalid soundfont file: pbag has %lu bags, but presets refer to %lu.",
+			(unsigned long)npbags, (unsigned long)preset_bags[npresets-1] + 1);
 	}
-#endif
 
 	// pmod chunk
-	char pmod[5] = {0};
-	fread(pmod, 1, 4, fp);
-	if (strncmp(pmod, "pmod", 4) != 0) {
-		die("Invalid soundfont file: no pmod.");
-	}
-	u32 pmod_size = read_u32(fp);
-	u32 npmods = pmod_size / 10;
+	Chunk pmod;
+	u32 npmods = chunk_expect(&pdta, "pmod", 10, &pmod);
 	if (verbose) printf("There are %u preset modulators\n", (unsigned)npmods);
-	// skip PMOD chunk
-	fseek(fp, (long)pmod_size + ftell(fp), SEEK_SET);
-	
+
 	// pgen chunk
-	char pgen[5] = {0};
-	fread(pgen, 1, 4, fp);
-	if (strncmp(pgen, "pgen", 4) != 0) {
-		die("Invalid soundfont file: no pgen.");
-	}
-	u32 pgen_size = read_u32(fp);
-	u32 npgens = pgen_size / 4;
+	Chunk pgen;
+	u32 npgens = chunk_expect(&pdta, "pgen", 4, &pgen);
 	if (verbose) printf("There are %u preset generators\n", (unsigned)npgens - 1);
-	for (u32 i = 0; i < npgens; ++i) {
-		u16 gen_oper = read_u16(fp);
-		(void)gen_oper;
-		GenAmount amount;
-		fread(&amount, sizeof amount, 1, fp);
-	}
 
 	// inst chunk
-	char inst[5] = {0};
-	fread(inst, 1, 4, fp);
-	if (strncmp(inst, "inst", 4) != 0) {
-		die("Invalid soundfont file: no inst.");
+	Chunk inst;
+	u32 ninsts = chunk_expect(&pdta, "inst", 22, &inst);
+	if (ninsts < 1) {
+		die("Invalid soundfont file: no instruments (not even the terminal one).");
 	}
-	u32 inst_size = read_u32(fp);
-	u32 ninsts = inst_size / 22;
 	Instrument *insts = calloc(ninsts, sizeof *insts);
 	Instrument *instrument = insts;
 	for (u32 i = 0; i < ninsts; ++i, ++instrument) {
-		fread(instrument->name, 1, 20, fp);
-		instrument->bag_ndx = read_u16(fp);
+		chunk_bytes(&inst, instrument->name, 20);
+		instrument->bag_ndx = chunk_u16(&inst);
+		if (i > 0 && instrument->bag_ndx < instrument[-1].bag_ndx) {
+			die("Invalid soundfont file: instrument bag indices aren't increasing.");
+		}
 	#if 0
 		if (verbose) {
-			printf("---Instrument %u/%u: %s---", (unsigned)i+1, (unsigned)ninsts, name);
-			printf("Bag %u\n", bag_ndx);
+			printf("---Instrument %u/%u: %s---", (unsigned)i+1, (unsigned)ninsts, instrument->name);
+			printf("Bag %u\n", instrument->bag_ndx);
 		}
 	#endif
 	}
 	sound_font->insts = insts;
 	sound_font->ninsts = ninsts;
 
+	// now that we know how many instruments there are, resolve preset zones
+	PresetZone *preset_zones = calloc(npbags, sizeof *preset_zones);
+	u32 npreset_zones = 0;
+	preset = presets;
+	for (u32 i = 0; i < npresets-1; ++i, ++preset) {
+		preset->first_zone = npreset_zones;
+		// global zone (if there is one) has default ranges for the other zones
+		Range global_key = {0, 127}, global_vel = {0, 127};
+		for (u32 b = preset_bags[i]; b < preset_bags[i+1]; ++b) {
+			pbag.pos = 4 * b;
+			u32 gen_start = chunk_u16(&pbag);
+			pbag.pos = 4 * (b + 1);
+			u32 gen_end = chunk_u16(&pbag);
+			if (gen_start > gen_end || gen_end > npgens) {
+				die("Invalid soundfont file: bad generator indices in pbag.");
+			}
+			Range key = global_key, vel = global_vel;
+			i32 inst_ndx = -1;
+			for (u32 g = gen_start; g < gen_end; ++g) {
+				pgen.pos = 4 * g;
+				u16 oper = chunk_u16(&pgen);
+				GenAmount amount;
+				chunk_bytes(&pgen, &amount, sizeof amount);
+				switch (oper) {
+				case GEN_keyRange: key = amount.range; break;
+				case GEN_velRange: vel = amount.range; break;
+				case GEN_instrument: inst_ndx = amount.uint; break;
+				}
+			}
+			if (inst_ndx < 0) {
+				if (b == preset_bags[i]) {
+					global_key = key;
+					global_vel = vel;
+				}
+				continue;
+			}
+			if ((u32)inst_ndx + 1 >= ninsts) {
+				warn("Preset %s refers to instrument %ld, but there are only %lu.", preset->name,
+					(long)inst_ndx, (unsigned long)ninsts - 1);
+				continue;
+			}
+			PresetZone *zone = &preset_zones[npreset_zones++];
+			zone->key_lo = key.lo;
+			zone->key_hi = key.hi;
+			zone->vel_lo = vel.lo;
+			zone->vel_hi = vel.hi;
+			zone->inst = (u16)inst_ndx;
+		}
+		preset->nzones = npreset_zones - preset->first_zone;
+	}
+	free(preset_bags);
+	sound_font->presets = presets;
+	sound_font->npresets = npresets - 1;
+	sound_font->preset_zones = preset_zones;
+	sound_font->npreset_zones = npreset_zones;
+	build_preset_table(sound_font);
 
 	// ibag chunk
-	char ibag[5] = {0};
-	fread(ibag, 1, 4, fp);
-	if (strncmp(ibag, "ibag", 4) != 0) {
-		die("Invalid soundfont file: no ibag.");
-	}
-	u32 ibag_size = read_u32(fp);
-	(void)ibag_size;
-	long ibag_start = ftell(fp);
-	instrument = insts;
+	Chunk ibag;
+	u32 ibag_count = chunk_expect(&pdta, "ibag", 4, &ibag);
 	u32 nibags = (u32)(insts[ninsts-1].bag_ndx + 1 /* terminating */);
-	Bag *ibags = calloc(nibags, sizeof *ibags);
+	if (nibags > ibag_count) {
+		die("Invalid soundfont file: ibag has %lu bags, but instruments refer to %lu.",
+			(unsigned long)ibag_count, (unsigned long)nibags);
+	} else if (nibags < ibag_count) {
+		warn("Wrong ibag size, expected %lu bags but got %lu.", (unsigned long)nibags, (unsigned long)ibag_count);
+	}
+	u32 ngen_zones = nibags - 1;
+	GenZone *gen_zones = calloc(ngen_zones, sizeof *gen_zones);
 	{
-		Bag *bag = ibags;
-		for (u32 i = 0; i < nibags; ++i, ++bag) {
-			bag->gen_ndx = read_u16(fp);
-			bag->mod_ndx = read_u16(fp);
+		u16 gen_ndx = chunk_u16(&ibag);
+		chunk_u16(&ibag); // mod_ndx
+		for (u32 i = 0; i < ngen_zones; ++i) {
+			gen_zones[i].start = gen_ndx;
+			gen_ndx = chunk_u16(&ibag);
+			chunk_u16(&ibag);
+			gen_zones[i].end = gen_ndx;
 		}
 	}
+	sound_font->gen_zones = gen_zones;
+	sound_font->ngen_zones = ngen_zones;
 
 	instrument = insts;
 	for (u32 i = 0; i < ninsts-1; ++i, ++instrument) {
-		u32 nbags = (u32)(instrument[1].bag_ndx - instrument->bag_ndx);
-		instrument->ngen_zones = nbags;
-		GenZone *gen_zones = instrument->gen_zones = calloc(instrument->ngen_zones, sizeof *gen_zones);
-		GenZone *gen_zone = gen_zones;
-		Bag *bag = &ibags[instrument->bag_ndx];
-		for (u32 j = 0; j < nbags; ++j, ++gen_zone, ++bag) {
-			gen_zone->start = bag->gen_ndx;
-			gen_zone->end = bag[1].gen_ndx;
-		}
-	}
-
-	if (ibag_start + (long)ibag_size != ftell(fp)) {
-		warn("Wrong ibag size, expected %ld but got %ld.", (long)ibag_size, ftell(fp) - ibag_start);
-		fseek(fp, ibag_start + (long)ibag_size, SEEK_SET);
+		instrument->ngen_zones = (u32)(instrument[1].bag_ndx - instrument->bag_ndx);
+		instrument->gen_zones = &gen_zones[instrument->bag_ndx];
 	}
 
-
-
 	// imod chunk
-	char imod[5] = {0};
-	fread(imod, 1, 4, fp);
-	if (strncmp(imod, "imod", 4) != 0) {
-		die("Invalid soundfont file: no imod.");
-	}
-	u32 imod_size = read_u32(fp);
-	u32 nimods = imod_size / 10;
+	Chunk imod;
+	u32 nimods = chunk_expect(&pdta, "imod", 10, &imod);
 	if (verbose) printf("There are %u instrument modulators\n", (unsigned)nimods - 1);
-	// skip IMOD chunk
-	fseek(fp, (long)imod_size + ftell(fp), SEEK_SET);
 
 	// igen chunk
-	char igen[5] = {0};
-	fread(igen, 1, 4, fp);
-	if (strncmp(igen, "igen", 4) != 0) {
-		die("Invalid soundfont file: no igen.");
-	}
-	u32 igen_size = read_u32(fp);
-	u32 nigens = igen_size / 4;
+	Chunk igen;
+	u32 nigens = chunk_expect(&pdta, "igen", 4, &igen);
 	Generator *igens = calloc(nigens, sizeof *igens);
 	Generator *gen = igens;
 	if (verbose) printf("There are %u instrument generators\n", (unsigned)nigens - 1);
 	for (u32 i = 0; i < nigens; ++i, ++gen) {
-		gen->oper = read_u16(fp);
-		fread(&gen->amount, sizeof gen->amount, 1, fp);
-
+		gen->oper = chunk_u16(&igen);
+		chunk_bytes(&igen, &gen->amount, sizeof gen->amount);
 #if 0
 		if (verbose) {
 			printf("---Generator %u/%u---\n", (unsigned)i+1, (unsigned)nigens);
@@ -816,30 +1351,30 @@ static void read_sound_font(FILE *fp, SoundFont *sound_font, bool verbose) {
 		}
 #endif
 	}
+	for (u32 i = 0; i < ngen_zones; ++i) {
+		if (gen_zones[i].start > gen_zones[i].end || gen_zones[i].end > nigens) {
+			die("Invalid soundfont file: bad generator indices in ibag.");
+		}
+	}
 	sound_font->igens = igens;
 	sound_font->nigens = nigens;
 
-	char shdr[5] = {0};
-	fread(shdr, 1, 4, fp);
-	if (strncmp(shdr, "shdr", 4) != 0) {
-		die("Invalid soundfont file: no shdr.");
-	}
-	u32 shdr_size = read_u32(fp);
-	u32 nshdrs = shdr_size / 46;
+	Chunk shdr;
+	u32 nshdrs = chunk_expect(&pdta, "shdr", 46, &shdr);
 	SampleHdr *shdrs = calloc(nshdrs, sizeof *shdrs);
 	SampleHdr *sample = shdrs;
 	for (u32 i = 0; i < nshdrs; ++i, ++sample) {
 		char *name = sample->name;
-		fread(name, 1, 20, fp);
-		u32 start = read_u32(fp);
-		u32 end = read_u32(fp);
-		u32 start_loop = read_u32(fp);
-		u32 end_loop = read_u32(fp);
-		u32 sample_rate = read_u32(fp);
-		u8 pitch = read_u8(fp);
-		i8 pitch_correction = read_i8(fp);
-		u16 sample_link = read_u16(fp);
-		u16 sample_type = read_u16(fp);
+		chunk_bytes(&shdr, name, 20);
+		u32 start = chunk_u32(&shdr);
+		u32 end = chunk_u32(&shdr);
+		u32 start_loop = chunk_u32(&shdr);
+		u32 end_loop = chunk_u32(&shdr);
+		u32 sample_rate = chunk_u32(&shdr);
+		u8 pitch = chunk_u8(&shdr);
+		i8 pitch_correction = chunk_i8(&shdr);
+		u16 sample_link = chunk_u16(&shdr);
+		u16 sample_type = chunk_u16(&shdr);
 		if (i == nshdrs-1) break;
 		(void)start; (void)end; (void)start_loop;
 		(void)end_loop; (void)sample_rate; (void)pitch;
@@ -850,6 +1385,8 @@ static void read_sound_font(FILE *fp, SoundFont *sound_font, bool verbose) {
 		sample->start_loop = start_loop;
 		sample->end_loop = end_loop;
 		sample->sample_rate = sample_rate;
+		sample->pitch = pitch;
+		sample->pitch_correction = pitch_correction;
 	#if 0
 		if (verbose) {
 			printf("---Sample %u/%u: %s---\n", (unsigned)i+1, (unsigned)nshdrs, name);
@@ -860,234 +1397,2890 @@ static void read_sound_font(FILE *fp, SoundFont *sound_font, bool verbose) {
 			printf("Sample link: %u Type: %u\n", sample_link, sample_type);
 		}
 	#endif
-		if (pitch_correction != 0) {
-			warn("Sample has pitch correction, but I'm not gonna deal with it.");
+		if (!(end <= nsamples && start < end)) {
+			die("Invalid soundfont file: sample %s goes from %lu to %lu, but there are %lu samples.",
+				name, (unsigned long)start, (unsigned long)end, (unsigned long)nsamples);
 		}
-		assert(end < nsamples && start < end);
-		//if (sample_rate == 32000 && strstr(name, "Piano")) {
 	}
 	sound_font->shdrs = shdrs;
 	sound_font->nshdrs = nshdrs;
+	free((void *)pdta.data);
+	sample_cache_init(sound_font);
 }
 
-static time_t start_second;
-
-static void time_init(void) {
-	struct timespec timespec = {0};
-	clock_gettime(CLOCK_MONOTONIC, &timespec);
-	start_second = timespec.tv_sec;
+// frees what read_sound_font allocated (or munmaps the index)
+static void free_sound_font(SoundFont *sound_font) {
+	if (sound_font->index_map) {
+		munmap(sound_font->index_map, sound_font->index_map_size);
+	} else {
+		free(sound_font->presets);
+		free(sound_font->preset_zones);
+		free(sound_font->preset_table);
+		free(sound_font->gen_zones);
+		free(sound_font->igens);
+		free(sound_font->shdrs);
+	}
+	free(sound_font->insts);
+	free(sound_font->sample_cache);
+	free(sound_font->sample_load_counts);
+	pthread_mutex_destroy(&sound_font->sample_cache_mutex);
+	if (sound_font->map)
+		munmap(sound_font->map, sound_font->map_size);
+	memset(sound_font, 0, sizeof *sound_font);
 }
 
-static u64 time_ns(void) {
-	struct timespec timespec = {0};
-	clock_gettime(CLOCK_MONOTONIC, &timespec);
-	return (u64)(timespec.tv_sec - start_second) * 1000000000 + (u64)timespec.tv_nsec;
+// maps the smpl chunk into memory, so that samples don't need to be copied out of the file.
+// returns false if this isn't possible, in which case samples will be read with pread.
+static bool map_sound_font_samples(SoundFont *sound_font) {
+	i64 offset = sound_font->sdta_offset;
+	if (offset % (i64)sizeof(i16) != 0) {
+		warn("smpl chunk isn't aligned. Not mapping it.");
+		return false;
+	}
+	// mmap offsets have to be a multiple of the page size
+	i64 map_offset = offset - offset % (i64)page_size;
+	size_t map_size = (size_t)(offset - map_offset) + (size_t)sound_font->nsamples * sizeof(i16);
+	void *map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fileno(sound_font->fp), (off_t)map_offset);
+	if (map == MAP_FAILED) {
+		warn("Couldn't map soundfont samples (%s).", strerror(errno));
+		return false;
+	}
+	sound_font->map = map;
+	sound_font->map_size = map_size;
+	sound_font->smpl = (i16 *)((char *)map + (offset - map_offset));
+	return true;
 }
 
-typedef struct {
-	bool exists;
-	u8 vel;
-	bool dampened;
-	bool down; // this can be different from dampened if the sustain pedal is down
-	float dampening; // how much it's been dampened
-	u32 pos; // which sample we are on
-} Note;
+/*
+	Parsing a big soundfont takes a while, so after parsing it we save the parts we need in an index file
+	(next to the soundfont if possible, otherwise in ~/.cache/smidi), which can just be mapped into memory next time.
+	The index is only used if the soundfont's size, modification time, and pdta hash all match.
+	It includes the preset hash table, so find_preset works straight out of the mapping.
+*/
+#define SOUND_FONT_INDEX_MAGIC "smidiidx"
+#define SOUND_FONT_INDEX_VERSION 3
 
 typedef struct {
-	pthread_mutex_t mutex;
-
-	snd_pcm_t *pcm;
-	Instrument *instrument;
-	u32 sample_rate;
-	Note notes[128]; // [i] = Note #i
+	char magic[8];
+	u32 version;
+	u32 header_size; // sizeof(SoundFontIndexHeader), in case struct layouts differ
+	u64 file_size;
+	i64 mtime_sec;
+	i64 mtime_nsec;
+	u64 pdta_hash;
+	i64 pdta_offset;
+	u32 pdta_size;
+	u32 nsamples;
+	i64 sdta_offset;
+	u32 ninsts, ngen_zones, nigens, nshdrs;
+	u32 npresets, npreset_zones, preset_table_size;
+	// offsets of arrays from the start of the file
+	u64 insts_offset, gen_zones_offset, igens_offset, shdrs_offset;
+	u64 presets_offset, preset_zones_offset, preset_table_offset;
+} SoundFontIndexHeader;
 
-	bool out_wav;
-	i16 *out_wav_data; // we store this in memory to prevent underruns, then write it to disk at the end.
-	size_t out_wav_data_npages; // # of memory pages allocated for this
-	u32 out_wav_nframes;
-	
-	pthread_mutex_t output_mutex; // mutex specifically for output files, to be used instead of mutex
-} SoundThreadData;
+typedef struct {
+	char name[21];
+	u16 bag_ndx;
+	u32 ngen_zones;
+} IndexedInstrument;
 
-static unsigned long page_size;
+static bool hash_pdta(SoundFont const *sound_font, u64 *hash) {
+	size_t size = sound_font->pdta_size;
+	u8 *pdta = malloc(size);
+	ssize_t bytes_read = pread(fileno(sound_font->fp), pdta, size, (off_t)sound_font->pdta_offset);
+	bool success = bytes_read >= 0 && (size_t)bytes_read == size;
+	if (success) *hash = fnv1a64(pdta, size);
+	free(pdta);
+	return success;
+}
 
-static inline void sound_lock(SoundThreadData *sound) {
-	pthread_mutex_lock(&sound->mutex);
+// which = 0 for the index file next to the soundfont, 1 for the one in the cache directory
+static bool sound_font_index_filename(char const *sndfont_filename, int which, char *out, size_t out_size) {
+	if (which == 0) {
+		return (size_t)snprintf(out, out_size, "%s.smidx", sndfont_filename) < out_size;
+	}
+	char *path = realpath(sndfont_filename, NULL);
+	if (!path) return false;
+	u64 path_hash = fnv1a64(path, strlen(path));
+	free(path);
+	char const *cache_home = getenv("XDG_CACHE_HOME");
+	char const *home = getenv("HOME");
+	int len;
+	if (cache_home && *cache_home)
+		len = snprintf(out, out_size, "%s/smidi/%016llx.smidx", cache_home, (unsigned long long)path_hash);
+	else if (home && *home)
+		len = snprintf(out, out_size, "%s/.cache/smidi/%016llx.smidx", home, (unsigned long long)path_hash);
+	else
+		return false;
+	return len >= 0 && (size_t)len < out_size;
 }
-static inline void sound_unlock(SoundThreadData *sound) {
-	pthread_mutex_unlock(&sound->mutex);
+
+static bool index_array_ok(size_t map_size, u64 offset, u64 count, size_t elem_size) {
+	return offset <= map_size && count <= (map_size - offset) / elem_size;
 }
 
-static void finish_wav(SoundThreadData *sound, bool lock) {
-	if (lock) pthread_mutex_lock(&sound->output_mutex);
-	assert(sound->out_wav);
-	u32 data_chunk_size = sound->out_wav_nframes == U32_MAX ? U32_MAX : sound->out_wav_nframes * 4;
-	u32 riff_chunk_size = data_chunk_size + 36;
+// tries to fill out sound_font from an index file. returns false if there's no valid index.
+static bool read_sound_font_index(char const *sndfont_filename, FILE *fp, SoundFont *sound_font) {
+	struct stat sf_stat = {0};
+	if (fstat(fileno(fp), &sf_stat) < 0) return false;
 
-	char filename[32] = {0};
-	for (u32 i = 1;;++i) {
-		snprintf(filename, sizeof filename-1, "out-%02d.wav", i);
-		struct stat statbuf = {0};
-		if (stat(filename, &statbuf) < 0) {
-			if (errno == ENOENT) {
-				break;
-			} else {
-				warn("stat failed not stopping.");
+	for (int which = 0; which < 2; ++which) {
+		char filename[4096];
+		if (!sound_font_index_filename(sndfont_filename, which, filename, sizeof filename))
+			continue;
+		FILE *index_fp = fopen(filename, "rb");
+		if (!index_fp) continue;
+		struct stat index_stat = {0};
+		void *map = MAP_FAILED;
+		size_t map_size = 0;
+		if (fstat(fileno(index_fp), &index_stat) == 0 && (size_t)index_stat.st_size >= sizeof(SoundFontIndexHeader)) {
+			map_size = (size_t)index_stat.st_size;
+			map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fileno(index_fp), 0);
+		}
+		fclose(index_fp);
+		if (map == MAP_FAILED) continue;
+
+		SoundFontIndexHeader const *hdr = map;
+		bool valid = memcmp(hdr->magic, SOUND_FONT_INDEX_MAGIC, sizeof hdr->magic) == 0
+			&& hdr->version == SOUND_FONT_INDEX_VERSION
+			&& hdr->header_size == sizeof *hdr
+			&& hdr->file_size == (u64)sf_stat.st_size
+			&& hdr->mtime_sec == (i64)sf_stat.st_mtim.tv_sec
+			&& hdr->mtime_nsec == (i64)sf_stat.st_mtim.tv_nsec
+			&& hdr->ninsts > 0
+			&& index_array_ok(map_size, hdr->insts_offset, hdr->ninsts, sizeof(IndexedInstrument))
+			&& index_array_ok(map_size, hdr->gen_zones_offset, hdr->ngen_zones, sizeof(GenZone))
+			&& index_array_ok(map_size, hdr->igens_offset, hdr->nigens, sizeof(Generator))
+			&& index_array_ok(map_size, hdr->shdrs_offset, hdr->nshdrs, sizeof(SampleHdr))
+			&& index_array_ok(map_size, hdr->presets_offset, hdr->npresets, sizeof(Preset))
+			&& index_array_ok(map_size, hdr->preset_zones_offset, hdr->npreset_zones, sizeof(PresetZone))
+			&& hdr->preset_table_size > 0 && (hdr->preset_table_size & (hdr->preset_table_size - 1)) == 0
+			&& hdr->preset_table_size > hdr->npresets
+			&& index_array_ok(map_size, hdr->preset_table_offset, hdr->preset_table_size, sizeof(u32));
+		if (valid) {
+			sound_font->fp = fp;
+			sound_font->pdta_offset = hdr->pdta_offset;
+			sound_font->pdta_size = hdr->pdta_size;
+			u64 pdta_hash = 0;
+			valid = hash_pdta(sound_font, &pdta_hash) && pdta_hash == hdr->pdta_hash;
+		}
+		IndexedInstrument const *indexed_insts = (IndexedInstrument const *)((char const *)map + hdr->insts_offset);
+		for (u32 i = 0; valid && i < hdr->ninsts; ++i) {
+			if ((u64)indexed_insts[i].bag_ndx + indexed_insts[i].ngen_zones > hdr->ngen_zones)
+				valid = false;
+		}
+		Preset const *presets = (Preset const *)((char const *)map + hdr->presets_offset);
+		for (u32 i = 0; valid && i < hdr->npresets; ++i) {
+			if ((u64)presets[i].first_zone + presets[i].nzones > hdr->npreset_zones)
+				valid = false;
+		}
+		PresetZone const *preset_zones = (PresetZone const *)((char const *)map + hdr->preset_zones_offset);
+		for (u32 i = 0; valid && i < hdr->npreset_zones; ++i) {
+			if ((u32)preset_zones[i].inst + 1 >= hdr->ninsts)
+				valid = false;
+		}
+		u32 const *preset_table = (u32 const *)((char const *)map + hdr->preset_table_offset);
+		for (u32 i = 0; valid && i < hdr->preset_table_size; ++i) {
+			if (preset_table[i] > hdr->npresets)
+				valid = false;
+		}
+		GenZone const *gen_zones = (GenZone const *)((char const *)map + hdr->gen_zones_offset);
+		for (u32 i = 0; valid && i < hdr->ngen_zones; ++i) {
+			if (gen_zones[i].start > gen_zones[i].end || gen_zones[i].end > hdr->nigens)
+				valid = false;
+		}
+		// (the samples have to be in the smpl chunk, which has to be in the file)
+		if (valid && (hdr->sdta_offset < 0 || (u64)hdr->sdta_offset + 2 * (u64)hdr->nsamples > (u64)sf_stat.st_size))
+			valid = false;
+		SampleHdr const *shdrs = (SampleHdr const *)((char const *)map + hdr->shdrs_offset);
+		// (the last one is the terminal sample, which is all zeros)
+		for (u32 i = 0; valid && i + 1 < hdr->nshdrs; ++i) {
+			u64 start = shdrs[i].start, end = start + shdrs[i].count;
+			if (!(start < end && end <= hdr->nsamples && shdrs[i].start_loop <= hdr->nsamples
+				&& shdrs[i].end_loop <= hdr->nsamples))
+				valid = false;
+		}
+		if (!valid) {
+			munmap(map, map_size);
+			continue;
+		}
+
+		char *base = map;
+		sound_font->index_map = map;
+		sound_font->index_map_size = map_size;
+		sound_font->nsamples = hdr->nsamples;
+		sound_font->sdta_offset = hdr->sdta_offset;
+		sound_font->ngen_zones = hdr->ngen_zones;
+		sound_font->gen_zones = (GenZone *)(base + hdr->gen_zones_offset);
+		sound_font->nigens = hdr->nigens;
+		sound_font->igens = (Generator *)(base + hdr->igens_offset);
+		sound_font->nshdrs = hdr->nshdrs;
+		sound_font->shdrs = (SampleHdr *)(base + hdr->shdrs_offset);
+		sound_font->npresets = hdr->npresets;
+		sound_font->presets = (Preset *)(base + hdr->presets_offset);
+		sound_font->npreset_zones = hdr->npreset_zones;
+		sound_font->preset_zones = (PresetZone *)(base + hdr->preset_zones_offset);
+		sound_font->preset_table_size = hdr->preset_table_size;
+		sound_font->preset_table = (u32 *)(base + hdr->preset_table_offset);
+		u32 ninsts = hdr->ninsts;
+		Instrument *insts = calloc(ninsts, sizeof *insts);
+		for (u32 i = 0; i < ninsts; ++i) {
+			memcpy(insts[i].name, indexed_insts[i].name, sizeof insts[i].name);
+			insts[i].bag_ndx = indexed_insts[i].bag_ndx;
+			insts[i].ngen_zones = indexed_insts[i].ngen_zones;
+			if (insts[i].ngen_zones)
+				insts[i].gen_zones = &sound_font->gen_zones[insts[i].bag_ndx];
+		}
+		sound_font->insts = insts;
+		sound_font->ninsts = ninsts;
+		sample_cache_init(sound_font);
+		return true;
+	}
+	return false;
+}
+
+static void index_write_array(FILE *fp, u64 *offset, void const *data, size_t count, size_t elem_size) {
+	// keep everything 8-byte aligned, so it can be used straight out of the mapping
+	while (ftello(fp) % 8) putc(0, fp);
+	*offset = (u64)ftello(fp);
+	if (count) fwrite(data, elem_size, count, fp);
+}
+
+// saves an index for sound_font, which was just read with read_sound_font.
+static void write_sound_font_index(char const *sndfont_filename, SoundFont const *sound_font) {
+	struct stat sf_stat = {0};
+	if (fstat(fileno(sound_font->fp), &sf_stat) < 0) return;
+	SoundFontIndexHeader hdr = {0};
+	memcpy(hdr.magic, SOUND_FONT_INDEX_MAGIC, sizeof hdr.magic);
+	hdr.version = SOUND_FONT_INDEX_VERSION;
+	hdr.header_size = sizeof hdr;
+	hdr.file_size = (u64)sf_stat.st_size;
+	hdr.mtime_sec = (i64)sf_stat.st_mtim.tv_sec;
+	hdr.mtime_nsec = (i64)sf_stat.st_mtim.tv_nsec;
+	hdr.pdta_hash = sound_font->pdta_hash;
+	hdr.pdta_offset = sound_font->pdta_offset;
+	hdr.pdta_size = sound_font->pdta_size;
+	hdr.nsamples = sound_font->nsamples;
+	hdr.sdta_offset = sound_font->sdta_offset;
+	hdr.ninsts = sound_font->ninsts;
+	hdr.ngen_zones = sound_font->ngen_zones;
+	hdr.nigens = sound_font->nigens;
+	hdr.nshdrs = sound_font->nshdrs;
+	hdr.npresets = sound_font->npresets;
+	hdr.npreset_zones = sound_font->npreset_zones;
+	hdr.preset_table_size = sound_font->preset_table_size;
+
+	IndexedInstrument *indexed_insts = calloc(sound_font->ninsts, sizeof *indexed_insts);
+	for (u32 i = 0; i < sound_font->ninsts; ++i) {
+		Instrument const *inst = &sound_font->insts[i];
+		memcpy(indexed_insts[i].name, inst->name, sizeof indexed_insts[i].name);
+		indexed_insts[i].bag_ndx = inst->bag_ndx;
+		indexed_insts[i].ngen_zones = inst->ngen_zones;
+	}
+
+	for (int which = 0; which < 2; ++which) {
+		char filename[4096], tmp_filename[4200];
+		if (!sound_font_index_filename(sndfont_filename, which, filename, sizeof filename))
+			continue;
+		if (which == 1) {
+			// make sure the cache directory exists
+			char dir[4096];
+			strcpy(dir, filename);
+			for (char *p = dir + 1; *p; ++p) {
+				if (*p == '/') {
+					*p = '\0';
+					mkdir(dir, 0755);
+					*p = '/';
+				}
+			}
+		}
+		snprintf(tmp_filename, sizeof tmp_filename, "%s.%ld.tmp", filename, (long)getpid());
+		FILE *fp = fopen(tmp_filename, "wb");
+		if (!fp) continue;
+		fwrite(&hdr, sizeof hdr, 1, fp);
+		index_write_array(fp, &hdr.insts_offset, indexed_insts, sound_font->ninsts, sizeof *indexed_insts);
+		index_write_array(fp, &hdr.gen_zones_offset, sound_font->gen_zones, sound_font->ngen_zones, sizeof(GenZone));
+		index_write_array(fp, &hdr.igens_offset, sound_font->igens, sound_font->nigens, sizeof(Generator));
+		index_write_array(fp, &hdr.shdrs_offset, sound_font->shdrs, sound_font->nshdrs, sizeof(SampleHdr));
+		index_write_array(fp, &hdr.presets_offset, sound_font->presets, sound_font->npresets, sizeof(Preset));
+		index_write_array(fp, &hdr.preset_zones_offset, sound_font->preset_zones, sound_font->npreset_zones, sizeof(PresetZone));
+		index_write_array(fp, &hdr.preset_table_offset, sound_font->preset_table, sound_font->preset_table_size, sizeof(u32));
+		// now that we know the offsets, rewrite the header
+		fseeko(fp, 0, SEEK_SET);
+		fwrite(&hdr, sizeof hdr, 1, fp);
+		bool success = !ferror(fp);
+		success &= fclose(fp) == 0;
+		if (success && rename(tmp_filename, filename) == 0)
+			break;
+		remove(tmp_filename);
+	}
+	free(indexed_insts);
+}
+
+static time_t start_second;
+
+static void time_init(void) {
+	struct timespec timespec = {0};
+	clock_gettime(CLOCK_MONOTONIC, &timespec);
+	start_second = timespec.tv_sec;
+}
+
+static u64 time_ns(void) {
+	struct timespec timespec = {0};
+	clock_gettime(CLOCK_MONOTONIC, &timespec);
+	return (u64)(timespec.tv_sec - start_second) * 1000000000 + (u64)timespec.tv_nsec;
+}
+
+// CPU time used by the calling thread
+static u64 thread_cpu_ns(void) {
+	struct timespec timespec = {0};
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &timespec);
+	return (u64)timespec.tv_sec * 1000000000 + (u64)timespec.tv_nsec;
+}
+
+/*
+	Streaming (--stream): only the first part of each non-looped sample is kept in memory
+	(so notes can start right away), and the rest is read from the soundfont by stream_thread
+	into a ring buffer for each note, a bit ahead of where the note is playing.
+*/
+#define MAX_STREAMS 64 // max notes which can be streaming at once
+#define STREAM_RING_SIZE (1u<<16) // frames. must be a power of 2
+#define STREAM_READ_SIZE 4096 // max frames to read at once
+#define STREAM_MIN_PREFETCH_NS 40000000 // keep at least a few periods of audio ahead of each note
+
+typedef enum {
+	STREAM_FREE,
+	STREAM_ACTIVE,
+	STREAM_RELEASED // the note's done with it, but stream_thread might still be reading into it
+} StreamState;
+
+typedef struct {
+	u32 state; // StreamState. accessed atomically, and only stream_thread sets it to STREAM_FREE
+	bool stereo;
+	i64 offset_L, offset_R; // file offsets of the samples
+	u32 count; // total number of samples
+	u32 frames_per_sec; // how fast the note is going through the samples
+	u32 read_pos; // set by the sound thread: samples before this won't be needed any more
+	u32 write_pos; // set by stream_thread: samples from read_pos up to this are in the ring buffers
+	i16 *ring_L, *ring_R; // [i % STREAM_RING_SIZE] = sample i
+} Stream;
+
+typedef struct {
+	int fd;
+	Stream streams[MAX_STREAMS];
+	u64 underruns; // number of times a note caught up with what had been read
+	u64 stream_shortages; // notes which were cut off because all the streams were in use
+	u64 read_latency_ns; // moving average of how long a read takes
+	u64 prefetch_ns; // how far ahead of notes stream_thread is reading (adapts to read_latency_ns)
+} Streamer;
+
+static void streamer_init(Streamer *streamer, SoundFont *sndfont) {
+	streamer->fd = fileno(sndfont->fp);
+	i16 *rings = calloc((size_t)MAX_STREAMS * 2 * STREAM_RING_SIZE, sizeof *rings);
+	if (!rings) die("Out of memory.");
+	for (u32 i = 0; i < MAX_STREAMS; ++i) {
+		Stream *stream = &streamer->streams[i];
+		stream->ring_L = rings + (2 * i) * STREAM_RING_SIZE;
+		stream->ring_R = rings + (2 * i + 1) * STREAM_RING_SIZE;
+	}
+	streamer->prefetch_ns = STREAM_MIN_PREFETCH_NS;
+}
+
+// start streaming the rest of a zone's samples. returns NULL if there aren't any free streams.
+static Stream *stream_start(Streamer *streamer, Zone *zone) {
+	Samples *samples_L = zone->samples_L, *samples_R = zone->samples_R;
+	for (u32 i = 0; i < MAX_STREAMS; ++i) {
+		Stream *stream = &streamer->streams[i];
+		if (__atomic_load_n(&stream->state, __ATOMIC_ACQUIRE) != STREAM_FREE)
+			continue;
+		stream->stereo = samples_L != samples_R;
+		stream->offset_L = samples_L->file_offset;
+		stream->offset_R = samples_R->file_offset;
+		stream->count = samples_L->count;
+		stream->frames_per_sec = samples_L->sample_rate;
+		stream->read_pos = 0;
+		// start reading from the first sample which isn't in memory
+		stream->write_pos = samples_L->resident < samples_R->resident ? samples_L->resident : samples_R->resident;
+		__atomic_store_n(&stream->state, STREAM_ACTIVE, __ATOMIC_RELEASE);
+		return stream;
+	}
+	__atomic_fetch_add(&streamer->stream_shortages, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static void stream_stop(Stream *stream) {
+	__atomic_store_n(&stream->state, STREAM_RELEASED, __ATOMIC_RELEASE);
+}
+
+static void stream_read(Streamer *streamer, i16 *ring, i64 offset, u32 pos, u32 n) {
+	size_t bytes = n * sizeof *ring;
+	i16 *dest = &ring[pos & (STREAM_RING_SIZE - 1)];
+	ssize_t bytes_read = pread(streamer->fd, dest, bytes, (off_t)(offset + (i64)pos * (i64)sizeof *ring));
+	if (bytes_read < 0 || (size_t)bytes_read != bytes) {
+		// play silence instead
+		size_t valid = bytes_read < 0 ? 0 : (size_t)bytes_read;
+		memset((char *)dest + valid, 0, bytes - valid);
+	}
+}
+
+static void *stream_thread(void *vstreamer) {
+	Streamer *streamer = vstreamer;
+	u64 underruns_reported = 0, shortages_reported = 0;
+	while (1) {
+		bool did_anything = false;
+		for (u32 i = 0; i < MAX_STREAMS; ++i) {
+			Stream *stream = &streamer->streams[i];
+			u32 state = __atomic_load_n(&stream->state, __ATOMIC_ACQUIRE);
+			if (state == STREAM_RELEASED) {
+				// we're not in the middle of reading into it, so it can be reused now
+				__atomic_store_n(&stream->state, STREAM_FREE, __ATOMIC_RELEASE);
+				continue;
+			}
+			if (state != STREAM_ACTIVE) continue;
+			u32 read_pos = __atomic_load_n(&stream->read_pos, __ATOMIC_ACQUIRE);
+			u32 write_pos = stream->write_pos;
+			if (write_pos >= stream->count) continue; // all done
+			if (read_pos > write_pos) read_pos = write_pos;
+			u64 frames_per_sec = __atomic_load_n(&stream->frames_per_sec, __ATOMIC_RELAXED);
+			u64 prefetch = streamer->prefetch_ns * frames_per_sec / 1000000000 + STREAM_READ_SIZE;
+			if (prefetch > STREAM_RING_SIZE) prefetch = STREAM_RING_SIZE;
+			if (write_pos - read_pos >= prefetch) continue; // far enough ahead
+			u32 n = STREAM_READ_SIZE;
+			if (n > stream->count - write_pos) n = stream->count - write_pos;
+			if (n > STREAM_RING_SIZE - (write_pos - read_pos)) n = STREAM_RING_SIZE - (write_pos - read_pos);
+			// don't wrap around the end of the ring buffer
+			u32 until_wrap = STREAM_RING_SIZE - (write_pos & (STREAM_RING_SIZE - 1));
+			if (n > until_wrap) n = until_wrap;
+			if (n == 0) continue;
+
+			u64 start = time_ns();
+			stream_read(streamer, stream->ring_L, stream->offset_L, write_pos, n);
+			if (stream->stereo)
+				stream_read(streamer, stream->ring_R, stream->offset_R, write_pos, n);
+			u64 latency = time_ns() - start;
+			streamer->read_latency_ns = (streamer->read_latency_ns * 7 + latency) / 8;
+			__atomic_store_n(&stream->write_pos, write_pos + n, __ATOMIC_RELEASE);
+			did_anything = true;
+		}
+		// stay far enough ahead that a few slow reads in a row won't cause underruns
+		u64 prefetch_ns = streamer->read_latency_ns * 8;
+		if (prefetch_ns < STREAM_MIN_PREFETCH_NS) prefetch_ns = STREAM_MIN_PREFETCH_NS;
+		streamer->prefetch_ns = prefetch_ns;
+
+		u64 underruns = __atomic_load_n(&streamer->underruns, __ATOMIC_RELAXED);
+		if (underruns != underruns_reported) {
+			printf("Streaming underrun (%llu so far). Reads are taking %.2fms; reading %.0fms ahead now.\n",
+				(unsigned long long)underruns, (double)streamer->read_latency_ns * 1e-6, (double)prefetch_ns * 1e-6);
+			underruns_reported = underruns;
+		}
+		u64 shortages = __atomic_load_n(&streamer->stream_shortages, __ATOMIC_RELAXED);
+		if (shortages != shortages_reported) {
+			printf("Too many notes streaming at once (%d max), so some were cut short.\n", MAX_STREAMS);
+			shortages_reported = shortages;
+		}
+
+		if (!did_anything) {
+			// wait for a new stream, or for notes to play some more of what's been read.
+			// (this is polled, so that starting a stream from the sound thread doesn't need any locks)
+			struct timespec wait = {.tv_nsec = 1000000};
+			nanosleep(&wait, NULL);
+		}
+	}
+	return NULL;
+}
+
+/*
+	Mixing kernels.
+	mix: out_L[k] += in_L[(phase + k * inc) >> 32] * gain_L for k < n (and the same for R).
+	  phase and inc are 32.32 fixed-point.
+	  The caller makes sure every index (plus 1) is in range.
+	  Each instruction set has one mix template, which is instantiated by MIX_VARIANTS for each
+	  combination of mono (in_L == in_R, and in_R isn't read) and unity (inc is exactly 1.0,
+	  and phase is a whole number, so the samples can just be loaded in order).
+	  voice_init picks the right one for each voice.
+	to_s16: interleaves in_L and in_R into out, rounding and saturating to 16 bits.
+	There's a version of each for several instruction sets; simd_init picks the best one the CPU supports.
+*/
+typedef void MixFn(float *out_L, float *out_R, i16 const *in_L, i16 const *in_R, u32 n,
+	u64 phase, u64 inc, float gain_L, float gain_R);
+typedef void ToS16Fn(i16 *out, float const *in_L, float const *in_R, u32 n);
+
+static inline i16 sample_to_s16(float x) {
+	if (x >= 32767.0f) return 32767;
+	if (x <= -32768.0f) return -32768;
+	// round to nearest even, like cvtps2dq does (adding and subtracting 1.5*2^23 leaves no fraction bits)
+	return (i16)(i32)((x + 12582912.0f) - 12582912.0f);
+}
+
+#define MIX_PARAMS float *out_L, float *out_R, i16 const *in_L, i16 const *in_R, u32 n, \
+	u64 phase, u64 inc, float gain_L, float gain_R
+#define MIX_ARGS out_L, out_R, in_L, in_R, n, phase, inc, gain_L, gain_R
+
+// defines mix_<isa>_<variant> for each variant of the mix_<isa> template, with the given target attributes
+#define MIX_VARIANTS(isa, attrs) \
+	attrs static void mix_##isa##_stereo(MIX_PARAMS) { mix_##isa(MIX_ARGS, false, false); } \
+	attrs static void mix_##isa##_stereo_unity(MIX_PARAMS) { mix_##isa(MIX_ARGS, false, true); } \
+	attrs static void mix_##isa##_mono(MIX_PARAMS) { mix_##isa(MIX_ARGS, true, false); } \
+	attrs static void mix_##isa##_mono_unity(MIX_PARAMS) { mix_##isa(MIX_ARGS, true, true); }
+// the variants of mix_<isa> in the order of Kernels.mix
+#define MIX_VARIANT_TABLE(isa) {{mix_##isa##_stereo, mix_##isa##_stereo_unity}, {mix_##isa##_mono, mix_##isa##_mono_unity}}
+
+static inline __attribute__((always_inline)) void mix_scalar(MIX_PARAMS, bool mono, bool unity) {
+	if (unity) {
+		i16 const *pl = in_L + (phase >> 32), *pr = in_R + (phase >> 32);
+		for (u32 k = 0; k < n; ++k) {
+			float l = (float)pl[k], r = mono ? l : (float)pr[k];
+			out_L[k] += l * gain_L;
+			out_R[k] += r * gain_R;
+		}
+		return;
+	}
+	for (u32 k = 0; k < n; ++k, phase += inc) {
+		u32 i = (u32)(phase >> 32);
+		float l = (float)in_L[i], r = mono ? l : (float)in_R[i];
+		out_L[k] += l * gain_L;
+		out_R[k] += r * gain_R;
+	}
+}
+MIX_VARIANTS(scalar, )
+
+static void to_s16_scalar(i16 *out, float const *in_L, float const *in_R, u32 n) {
+	for (u32 k = 0; k < n; ++k) {
+		out[2*k] = sample_to_s16(in_L[k]);
+		out[2*k+1] = sample_to_s16(in_R[k]);
+	}
+}
+
+#if defined __x86_64__ || defined __i386__
+#include <immintrin.h>
+
+__attribute__((target("sse2"), always_inline))
+static inline void mix_sse2(MIX_PARAMS, bool mono, bool unity) {
+	__m128 const gl = _mm_set1_ps(gain_L), gr = _mm_set1_ps(gain_R);
+	u32 k = 0;
+	if (unity) {
+		i16 const *pl = in_L + (phase >> 32), *pr = in_R + (phase >> 32);
+		for (; k + 8 <= n; k += 8) {
+			// sign-extend 8 samples to 32 bits by putting them in the top half and shifting down
+			__m128i l = _mm_loadu_si128((__m128i const *)(pl + k));
+			__m128 l0 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(l, l), 16));
+			__m128 l1 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(l, l), 16));
+			__m128 r0 = l0, r1 = l1;
+			if (!mono) {
+				__m128i r = _mm_loadu_si128((__m128i const *)(pr + k));
+				r0 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(r, r), 16));
+				r1 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(r, r), 16));
+			}
+			_mm_storeu_ps(out_L + k, _mm_add_ps(_mm_loadu_ps(out_L + k), _mm_mul_ps(l0, gl)));
+			_mm_storeu_ps(out_L + k + 4, _mm_add_ps(_mm_loadu_ps(out_L + k + 4), _mm_mul_ps(l1, gl)));
+			_mm_storeu_ps(out_R + k, _mm_add_ps(_mm_loadu_ps(out_R + k), _mm_mul_ps(r0, gr)));
+			_mm_storeu_ps(out_R + k + 4, _mm_add_ps(_mm_loadu_ps(out_R + k + 4), _mm_mul_ps(r1, gr)));
+		}
+	} else {
+		for (; k + 4 <= n; k += 4) {
+			u32 idx[4];
+			for (u32 j = 0; j < 4; ++j)
+				idx[j] = (u32)((phase + (k + j) * inc) >> 32);
+			// no gather instruction, so load the samples one by one
+			__m128 l = _mm_cvtepi32_ps(_mm_set_epi32(in_L[idx[3]], in_L[idx[2]], in_L[idx[1]], in_L[idx[0]]));
+			__m128 r = mono ? l : _mm_cvtepi32_ps(_mm_set_epi32(in_R[idx[3]], in_R[idx[2]], in_R[idx[1]], in_R[idx[0]]));
+			_mm_storeu_ps(out_L + k, _mm_add_ps(_mm_loadu_ps(out_L + k), _mm_mul_ps(l, gl)));
+			_mm_storeu_ps(out_R + k, _mm_add_ps(_mm_loadu_ps(out_R + k), _mm_mul_ps(r, gr)));
+		}
+	}
+	mix_scalar(out_L + k, out_R + k, in_L, in_R, n - k, phase + k * inc, inc, gain_L, gain_R, mono, unity);
+}
+
+__attribute__((target("sse2")))
+static void to_s16_sse2(i16 *out, float const *in_L, float const *in_R, u32 n) {
+	u32 k = 0;
+	for (; k + 4 <= n; k += 4) {
+		__m128 l = _mm_loadu_ps(in_L + k), r = _mm_loadu_ps(in_R + k);
+		// L0 R0 L1 R1, L2 R2 L3 R3
+		__m128i a = _mm_cvtps_epi32(_mm_unpacklo_ps(l, r));
+		__m128i b = _mm_cvtps_epi32(_mm_unpackhi_ps(l, r));
+		_mm_storeu_si128((__m128i *)(out + 2*k), _mm_packs_epi32(a, b));
+	}
+	to_s16_scalar(out + 2*k, in_L + k, in_R + k, n - k);
+}
+MIX_VARIANTS(sse2, __attribute__((target("sse2"))))
+
+// gathers 8 samples. this reads 32 bits for each one, so data[idx + 1] must also be in range.
+__attribute__((target("avx2,fma")))
+static inline __m256 gather8_avx2(i16 const *data, __m256i idx) {
+	__m256i x = _mm256_i32gather_epi32((int const *)data, idx, 2);
+	return _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(x, 16), 16));
+}
+
+__attribute__((target("avx2,fma"), always_inline))
+static inline void mix_avx2(MIX_PARAMS, bool mono, bool unity) {
+	__m256 const gl = _mm256_set1_ps(gain_L), gr = _mm256_set1_ps(gain_R);
+	u32 k = 0;
+	if (unity) {
+		i16 const *pl = in_L + (phase >> 32), *pr = in_R + (phase >> 32);
+		for (; k + 8 <= n; k += 8) {
+			__m256 l = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((__m128i const *)(pl + k))));
+			__m256 r = mono ? l : _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((__m128i const *)(pr + k))));
+			_mm256_storeu_ps(out_L + k, _mm256_fmadd_ps(l, gl, _mm256_loadu_ps(out_L + k)));
+			_mm256_storeu_ps(out_R + k, _mm256_fmadd_ps(r, gr, _mm256_loadu_ps(out_R + k)));
+		}
+	} else {
+		// phases for frames k..k+3 and k+4..k+7
+		__m256i p0 = _mm256_set_epi64x((i64)(phase + 3 * inc), (i64)(phase + 2 * inc), (i64)(phase + inc), (i64)phase);
+		__m256i p1 = _mm256_add_epi64(p0, _mm256_set1_epi64x((i64)(4 * inc)));
+		__m256i const step = _mm256_set1_epi64x((i64)(8 * inc));
+		__m256i const order = _mm256_set_epi32(7, 5, 3, 1, 6, 4, 2, 0);
+		for (; k + 8 <= n; k += 8) {
+			// the integer parts of p0 in the even slots and p1 in the odd slots, then put them in order
+			__m256i idx = _mm256_blend_epi32(_mm256_srli_epi64(p0, 32), p1, 0xaa);
+			idx = _mm256_permutevar8x32_epi32(idx, order);
+			p0 = _mm256_add_epi64(p0, step);
+			p1 = _mm256_add_epi64(p1, step);
+			__m256 l = gather8_avx2(in_L, idx);
+			__m256 r = mono ? l : gather8_avx2(in_R, idx);
+			_mm256_storeu_ps(out_L + k, _mm256_fmadd_ps(l, gl, _mm256_loadu_ps(out_L + k)));
+			_mm256_storeu_ps(out_R + k, _mm256_fmadd_ps(r, gr, _mm256_loadu_ps(out_R + k)));
+		}
+	}
+	mix_scalar(out_L + k, out_R + k, in_L, in_R, n - k, phase + k * inc, inc, gain_L, gain_R, mono, unity);
+}
+
+__attribute__((target("avx2")))
+static void to_s16_avx2(i16 *out, float const *in_L, float const *in_R, u32 n) {
+	u32 k = 0;
+	for (; k + 8 <= n; k += 8) {
+		__m256 l = _mm256_loadu_ps(in_L + k), r = _mm256_loadu_ps(in_R + k);
+		// unpack and pack work within 128-bit lanes, which happens to leave everything in order
+		__m256i a = _mm256_cvtps_epi32(_mm256_unpacklo_ps(l, r));
+		__m256i b = _mm256_cvtps_epi32(_mm256_unpackhi_ps(l, r));
+		_mm256_storeu_si256((__m256i *)(out + 2*k), _mm256_packs_epi32(a, b));
+	}
+	to_s16_sse2(out + 2*k, in_L + k, in_R + k, n - k);
+}
+MIX_VARIANTS(avx2, __attribute__((target("avx2,fma"))))
+
+// (without optimization, gcc's _mm512_i32gather_epi32 macro triggers a conversion warning)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wsign-conversion"
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512 gather16_avx512(i16 const *data, __m512i idx) {
+	__m512i x = _mm512_i32gather_epi32(idx, (int const *)data, 2);
+	return _mm512_cvtepi32_ps(_mm512_srai_epi32(_mm512_slli_epi32(x, 16), 16));
+}
+#pragma GCC diagnostic pop
+
+__attribute__((target("avx512f,avx512bw"), always_inline))
+static inline void mix_avx512(MIX_PARAMS, bool mono, bool unity) {
+	__m512 const gl = _mm512_set1_ps(gain_L), gr = _mm512_set1_ps(gain_R);
+	u32 k = 0;
+	if (unity) {
+		i16 const *pl = in_L + (phase >> 32), *pr = in_R + (phase >> 32);
+		for (; k + 16 <= n; k += 16) {
+			__m512 l = _mm512_cvtepi32_ps(_mm512_cvtepi16_epi32(_mm256_loadu_si256((__m256i const *)(pl + k))));
+			__m512 r = mono ? l : _mm512_cvtepi32_ps(_mm512_cvtepi16_epi32(_mm256_loadu_si256((__m256i const *)(pr + k))));
+			_mm512_storeu_ps(out_L + k, _mm512_fmadd_ps(l, gl, _mm512_loadu_ps(out_L + k)));
+			_mm512_storeu_ps(out_R + k, _mm512_fmadd_ps(r, gr, _mm512_loadu_ps(out_R + k)));
+		}
+	} else {
+		// phases for frames k..k+7 and k+8..k+15
+		__m512i p0 = _mm512_set_epi64((i64)(phase + 7 * inc), (i64)(phase + 6 * inc), (i64)(phase + 5 * inc),
+			(i64)(phase + 4 * inc), (i64)(phase + 3 * inc), (i64)(phase + 2 * inc), (i64)(phase + inc), (i64)phase);
+		__m512i p1 = _mm512_add_epi64(p0, _mm512_set1_epi64((i64)(8 * inc)));
+		__m512i const step = _mm512_set1_epi64((i64)(16 * inc));
+		for (; k + 16 <= n; k += 16) {
+			__m256i i0 = _mm512_cvtepi64_epi32(_mm512_srli_epi64(p0, 32));
+			__m256i i1 = _mm512_cvtepi64_epi32(_mm512_srli_epi64(p1, 32));
+			__m512i idx = _mm512_inserti64x4(_mm512_castsi256_si512(i0), i1, 1);
+			p0 = _mm512_add_epi64(p0, step);
+			p1 = _mm512_add_epi64(p1, step);
+			__m512 l = gather16_avx512(in_L, idx);
+			__m512 r = mono ? l : gather16_avx512(in_R, idx);
+			_mm512_storeu_ps(out_L + k, _mm512_fmadd_ps(l, gl, _mm512_loadu_ps(out_L + k)));
+			_mm512_storeu_ps(out_R + k, _mm512_fmadd_ps(r, gr, _mm512_loadu_ps(out_R + k)));
+		}
+	}
+	mix_scalar(out_L + k, out_R + k, in_L, in_R, n - k, phase + k * inc, inc, gain_L, gain_R, mono, unity);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void to_s16_avx512(i16 *out, float const *in_L, float const *in_R, u32 n) {
+	u32 k = 0;
+	for (; k + 16 <= n; k += 16) {
+		__m512 l = _mm512_loadu_ps(in_L + k), r = _mm512_loadu_ps(in_R + k);
+		__m512i a = _mm512_cvtps_epi32(_mm512_unpacklo_ps(l, r));
+		__m512i b = _mm512_cvtps_epi32(_mm512_unpackhi_ps(l, r));
+		_mm512_storeu_si512((void *)(out + 2*k), _mm512_packs_epi32(a, b));
+	}
+	to_s16_sse2(out + 2*k, in_L + k, in_R + k, n - k);
+}
+MIX_VARIANTS(avx512, __attribute__((target("avx512f,avx512bw"))))
+#endif
+
+typedef struct {
+	char const *name;
+	MixFn *mix[2][2]; // [mono][unity] (see MIX_VARIANTS)
+	ToS16Fn *to_s16;
+} Kernels;
+
+// in order of preference
+static Kernels const all_kernels[] = {
+#if defined __x86_64__ || defined __i386__
+	{"avx512", MIX_VARIANT_TABLE(avx512), to_s16_avx512},
+	{"avx2", MIX_VARIANT_TABLE(avx2), to_s16_avx2},
+	{"sse2", MIX_VARIANT_TABLE(sse2), to_s16_sse2},
+#endif
+	{"scalar", MIX_VARIANT_TABLE(scalar), to_s16_scalar},
+};
+
+static Kernels kernels = {"scalar", MIX_VARIANT_TABLE(scalar), to_s16_scalar};
+
+static bool kernels_supported(Kernels const *k) {
+#if defined __x86_64__ || defined __i386__
+	__builtin_cpu_init();
+	if (strcmp(k->name, "avx512") == 0)
+		return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+	if (strcmp(k->name, "avx2") == 0)
+		return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+	if (strcmp(k->name, "sse2") == 0)
+		return __builtin_cpu_supports("sse2");
+#endif
+	return strcmp(k->name, "scalar") == 0;
+}
+
+// picks the best kernels for this CPU
+static void simd_init(void) {
+	for (size_t i = 0; i < arr_count(all_kernels); ++i) {
+		if (kernels_supported(&all_kernels[i])) {
+			kernels = all_kernels[i];
+			return;
+		}
+	}
+}
+
+// max number of voices which can be playing at once (see --polyphony)
+#define MAX_POLYPHONY 1024
+// a key which is struck repeatedly with the sustain pedal down gets at most this many voices
+#define MAX_VOICES_PER_KEY 4
+
+typedef struct {
+	u8 channel;
+	u8 key;
+	u8 vel;
+	Instrument *instrument; // the channel's instrument when the note was played
+	Zone *zone;
+	bool down; // this can be different from VoiceArrays.dampened if the sustain pedal is down
+	u64 age; // value of SoundThreadData.voices_started when this voice started
+	Stream *stream; // if the zone's samples are being streamed
+	bool ended; // set when rendering the voice finishes it (it gets removed once all of them have been rendered)
+} Voice;
+
+// the state of each voice which is touched every period. [i] is for SoundThreadData.voices[i].
+// this is kept in separate arrays, so that envelopes and gains can be updated for every voice at once
+// (see update_voice_gains), and rendering a voice only pulls in a few cache lines.
+typedef struct {
+	__attribute__((aligned(64))) u64 phase[MAX_POLYPHONY]; // where we are in the samples (32.32 fixed-point)
+	__attribute__((aligned(64))) u64 phase_inc[MAX_POLYPHONY]; // how much phase goes up by each frame
+	__attribute__((aligned(64))) i16 const *data_L[MAX_POLYPHONY]; // zone->samples_L->data
+	__attribute__((aligned(64))) i16 const *data_R[MAX_POLYPHONY];
+	__attribute__((aligned(64))) float level[MAX_POLYPHONY]; // velocity / 128
+	__attribute__((aligned(64))) float dampening[MAX_POLYPHONY]; // how much it's been dampened
+	__attribute__((aligned(64))) float zone_gain_L[MAX_POLYPHONY];
+	__attribute__((aligned(64))) float zone_gain_R[MAX_POLYPHONY];
+	__attribute__((aligned(64))) float gain_L[MAX_POLYPHONY]; // level * dampening * zone gain (see update_voice_gains)
+	__attribute__((aligned(64))) float gain_R[MAX_POLYPHONY];
+	__attribute__((aligned(64))) u8 dampened[MAX_POLYPHONY];
+	__attribute__((aligned(64))) MixFn *mix[MAX_POLYPHONY]; // the kernel for this voice's zone and pitch
+} VoiceArrays;
+
+// which voice to cut off when we run out of voices
+typedef enum {
+	STEAL_RELEASED, // the quietest released voice, or the oldest voice if none have been released
+	STEAL_OLDEST,
+	STEAL_QUIETEST
+} StealPolicy;
+
+typedef enum {
+	EVENT_NOTE_ON,
+	EVENT_NOTE_OFF,
+	EVENT_SUSTAIN, // vel = 1 for down, 0 for up
+} EventType;
+
+typedef struct {
+	u8 type; // EventType
+	u8 channel;
+	u8 key;
+	u8 vel;
+	Instrument *instrument; // for EVENT_NOTE_ON. holds a reference (Instrument.voice_refs) which is passed on to the voice
+	u64 time; // time_ns() when the event was received
+} Event;
+
+#define EVENT_QUEUE_SIZE 1024 // must be a power of 2
+
+// single-producer (MIDI thread), single-consumer (sound thread) queue of events
+typedef struct {
+	Event events[EVENT_QUEUE_SIZE];
+	// the producer's and consumer's fields are on separate cache lines, since they're written by different threads
+	__attribute__((aligned(64))) u32 head; // written by the producer: events[tail..head) are in the queue
+	u32 high_water; // most events there have ever been in the queue at once (written by the producer)
+	u64 dropped; // events which didn't fit (written by the producer)
+	__attribute__((aligned(64))) u32 tail; // written by the consumer
+} EventQueue;
+
+// returns false if the queue is full
+static bool event_push(EventQueue *queue, Event const *event) {
+	u32 head = queue->head;
+	u32 used = head - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+	if (used >= EVENT_QUEUE_SIZE) {
+		__atomic_store_n(&queue->dropped, queue->dropped + 1, __ATOMIC_RELAXED);
+		return false;
+	}
+	queue->events[head & (EVENT_QUEUE_SIZE - 1)] = *event;
+	__atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+	if (used + 1 > queue->high_water)
+		__atomic_store_n(&queue->high_water, used + 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+// with --deterministic, voices are always mixed in this many groups, however many threads there are
+#define RENDER_GROUPS 16
+// below this many voices per thread, it's not worth waking the render threads up
+#define MIN_VOICES_PER_RENDER_THREAD 8
+// how long render threads spin waiting for more work before going to sleep
+#define RENDER_SPINS 20000
+
+// render threads which help the sound thread mix voices (see render_voices)
+typedef struct {
+	u32 nthreads; // not including the sound thread
+	// voices are split into this many groups, which are each mixed into their own bus,
+	// then the buses are added up in order.
+	u32 ngroups;
+	u32 bus_stride; // floats between buses
+	float *buses; // [2 * group * bus_stride], [(2 * group + 1) * bus_stride] = left, right bus for group
+	// the current job
+	u32 count; // number of frames to render
+	u32 group_starts[RENDER_GROUPS + 1]; // group g is voices[group_starts[g]..group_starts[g+1])
+	__attribute__((aligned(64))) u32 next_group; // next group for someone to render
+	__attribute__((aligned(64))) u32 groups_done;
+	__attribute__((aligned(64))) u32 generation; // incremented to wake the render threads up for a new job (futex)
+	u32 sleepers; // render threads waiting on generation
+} RenderPool;
+
+// render times are kept in a histogram where each power of 2 is split into 2^STATS_SUB_BITS buckets,
+// so they're accurate to about 6% whatever they are (see stats_bucket)
+#define STATS_SUB_BITS 4
+#define STATS_BUCKETS ((40 - STATS_SUB_BITS + 1) << STATS_SUB_BITS) // up to 2^40 ns
+// if this many ns have passed since an event arrived, something's very wrong, and it doesn't count towards MIDI lag
+#define MAX_EVENT_LAG_NS 1000000000
+
+// what the sound thread has been up to (see print_stats).
+// these are only written by the sound thread, with relaxed atomic stores, so any thread can read them without locking.
+typedef struct {
+	u64 periods;
+	u64 xruns; // underruns (or suspends) which snd_pcm_recover had to recover from
+	u64 render_hist[STATS_BUCKETS]; // [stats_bucket(ns)] = number of periods which took ns to render
+	u64 render_max_ns;
+	u64 late; // periods which took longer to render than they last
+	u32 voices; // voices playing at the end of the last period
+	u32 voices_max;
+	u64 events;
+	u64 event_lag_total_ns; // from when events arrive to when the sound thread gets to them
+	u64 event_lag_max_ns;
+} SoundStats;
+
+static u32 stats_bucket(u64 ns) {
+	if (ns < (1u << STATS_SUB_BITS)) return (u32)ns;
+	u32 e = 63 - (u32)__builtin_clzll(ns);
+	u32 b = (e - STATS_SUB_BITS + 1) << STATS_SUB_BITS | (u32)(ns >> (e - STATS_SUB_BITS) & ((1u << STATS_SUB_BITS) - 1));
+	return b < STATS_BUCKETS ? b : STATS_BUCKETS - 1;
+}
+
+// the most ns which go in bucket b
+static u64 stats_bucket_max(u32 b) {
+	if (b < (1u << STATS_SUB_BITS)) return b;
+	u32 e = (b >> STATS_SUB_BITS) + STATS_SUB_BITS - 1;
+	u64 sub = b & ((1u << STATS_SUB_BITS) - 1);
+	return (((1u << STATS_SUB_BITS) + sub + 1) << (e - STATS_SUB_BITS)) - 1;
+}
+
+// (only to be used by the thread which owns the stats)
+#define stats_add(field, n) __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+#define stats_max(field, x) do { if ((x) > (field)) __atomic_store_n(&(field), (x), __ATOMIC_RELAXED); } while (0)
+
+typedef struct {
+	snd_pcm_t *pcm;
+	Preset *channels[16]; // [i] = preset for MIDI channel i (only used by the MIDI thread)
+	Streamer *streamer; // NULL if we're not streaming
+	u32 sample_rate;
+	u32 period; // frames per period
+	bool realtime; // pre-fault the sound thread's stack and buffers (see --rt)
+	bool mmap_output; // convert straight into the sound card's buffer instead of using snd_pcm_writei
+	EventQueue events; // from the MIDI thread to the sound thread
+
+	// these are only touched by the sound thread
+	bool sustain[16]; // [i] = is the sustain pedal down on channel i?
+	Voice voices[MAX_POLYPHONY]; // voices[0..nvoices) are playing (in no particular order)
+	VoiceArrays voice_arrays;
+	u32 nvoices;
+	u32 polyphony; // max number of voices
+	StealPolicy steal;
+	u64 voices_started;
+	u64 voices_stolen;
+	RenderPool render_pool; // if render_pool.ngroups is 0, all voices are mixed by the sound thread
+	// [b] = how much a released voice's volume goes down by in 2^b frames, at release_rate (see update_voice_gains)
+	float release_factors[32];
+	u32 release_rate; // 0 if release_factors haven't been worked out yet
+	SoundStats stats;
+
+	bool out_wav;
+	i16 *out_wav_data; // we store this in memory to prevent underruns, then write it to disk at the end.
+	size_t out_wav_data_npages; // # of memory pages allocated for this
+	u32 out_wav_nframes;
+	
+	pthread_mutex_t output_mutex; // mutex specifically for output files, to be used instead of mutex
+} SoundThreadData;
+
+static void voice_remove(SoundThreadData *sound, u32 i) {
+	assert(i < sound->nvoices);
+	Voice *voice = &sound->voices[i];
+	if (voice->stream)
+		stream_stop(voice->stream);
+	// after this, the MIDI thread is free to unload the instrument
+	__atomic_fetch_sub(&voice->instrument->voice_refs, 1, __ATOMIC_RELEASE);
+	// keep the playing voices together
+	u32 last = --sound->nvoices;
+	*voice = sound->voices[last];
+	VoiceArrays *va = &sound->voice_arrays;
+	va->phase[i] = va->phase[last];
+	va->phase_inc[i] = va->phase_inc[last];
+	va->data_L[i] = va->data_L[last];
+	va->data_R[i] = va->data_R[last];
+	va->level[i] = va->level[last];
+	va->dampening[i] = va->dampening[last];
+	va->zone_gain_L[i] = va->zone_gain_L[last];
+	va->zone_gain_R[i] = va->zone_gain_R[last];
+	va->gain_L[i] = va->gain_L[last];
+	va->gain_R[i] = va->gain_R[last];
+	va->dampened[i] = va->dampened[last];
+	va->mix[i] = va->mix[last];
+}
+
+// roughly how loud voices[i] is right now
+static float voice_loudness(SoundThreadData *sound, u32 i) {
+	Voice const *voice = &sound->voices[i];
+	Zone const *zone = voice->zone;
+	float gain = zone->gain_L > zone->gain_R ? zone->gain_L : zone->gain_R;
+	return (float)voice->vel * sound->voice_arrays.dampening[i] * gain;
+}
+
+// is voices[a] a better voice to steal than voices[b]?
+static bool voice_steal_before(SoundThreadData *sound, u32 a, u32 b) {
+	u8 const *dampened = sound->voice_arrays.dampened;
+	u64 age_a = sound->voices[a].age, age_b = sound->voices[b].age;
+	switch (sound->steal) {
+	case STEAL_RELEASED:
+		if (dampened[a] != dampened[b]) return dampened[a];
+		if (dampened[a]) return voice_loudness(sound, a) < voice_loudness(sound, b);
+		return age_a < age_b;
+	case STEAL_OLDEST:
+		return age_a < age_b;
+	case STEAL_QUIETEST:
+		return voice_loudness(sound, a) < voice_loudness(sound, b);
+	}
+	return false;
+}
+
+// makes room for a new voice on channel/key if necessary, and returns its index
+// (it's zeroed, other than channel, key and age)
+static u32 voice_start(SoundThreadData *sound, u8 channel, u8 key) {
+	u32 on_key = 0, oldest_on_key = 0;
+	for (u32 i = 0; i < sound->nvoices; ++i) {
+		Voice *voice = &sound->voices[i];
+		if (voice->channel == channel && voice->key == key) {
+			if (on_key == 0 || voice->age < sound->voices[oldest_on_key].age)
+				oldest_on_key = i;
+			++on_key;
+		}
+	}
+	if (on_key >= MAX_VOICES_PER_KEY) {
+		voice_remove(sound, oldest_on_key);
+	} else if (sound->nvoices >= sound->polyphony) {
+		u32 victim = 0;
+		for (u32 i = 1; i < sound->nvoices; ++i) {
+			if (voice_steal_before(sound, i, victim))
+				victim = i;
+		}
+		voice_remove(sound, victim);
+		++sound->voices_stolen;
+	}
+	u32 i = sound->nvoices++;
+	Voice *voice = &sound->voices[i];
+	memset(voice, 0, sizeof *voice);
+	voice->channel = channel;
+	voice->key = key;
+	voice->age = sound->voices_started++;
+	return i;
+}
+
+// starts voices[i] playing zone
+static void voice_init(SoundThreadData *sound, u32 i, Instrument *inst, Zone *zone, u8 key, u8 vel) {
+	Voice *voice = &sound->voices[i];
+	VoiceArrays *va = &sound->voice_arrays;
+	voice->instrument = inst;
+	voice->zone = zone;
+	Samples *samples_L = zone->samples_L, *samples_R = zone->samples_R;
+	if (sound->streamer && (samples_L->resident < samples_L->count || samples_R->resident < samples_R->count))
+		voice->stream = stream_start(sound->streamer, zone);
+	voice->vel = vel;
+	voice->down = true;
+	va->phase[i] = 0;
+	va->phase_inc[i] = phase_increment(samples_L->sample_rate, sound->sample_rate, zone_key_cents(zone, key));
+	va->data_L[i] = samples_L->data;
+	va->data_R[i] = samples_R->data;
+	va->level[i] = (float)vel / 128.0f;
+	va->dampening[i] = 1;
+	va->dampened[i] = false;
+	va->zone_gain_L[i] = zone->gain_L;
+	va->zone_gain_R[i] = zone->gain_R;
+	// (phase always stays a whole number if inc is exactly 1)
+	va->mix[i] = kernels.mix[samples_L->data == samples_R->data][va->phase_inc[i] == (u64)1 << 32];
+}
+
+static void note_off(SoundThreadData *sound, u8 channel, u8 key) {
+	for (u32 i = 0; i < sound->nvoices; ++i) {
+		Voice *voice = &sound->voices[i];
+		if (voice->channel != channel || voice->key != key || !voice->down)
+			continue;
+		voice->down = false;
+		if (!sound->sustain[channel]) {
+			sound->voice_arrays.dampened[i] = true;
+			sound->voice_arrays.dampening[i] = 1.0f;
+		}
+	}
+}
+
+static void note_on(SoundThreadData *sound, u8 channel, u8 key, u8 vel, Instrument *inst) {
+	// if the key's struck again, the voices from before keep ringing, as if it had been released
+	note_off(sound, channel, key);
+	u32 i = voice_start(sound, channel, key);
+	voice_init(sound, i, inst, instrument_zone(inst, key, vel), key, vel);
+}
+
+static void sustain_pedal(SoundThreadData *sound, u8 channel, bool down) {
+	sound->sustain[channel] = down;
+	for (u32 i = 0; i < sound->nvoices; ++i) {
+		Voice *voice = &sound->voices[i];
+		if (voice->channel != channel) continue;
+		if (down)
+			sound->voice_arrays.dampened[i] = false;
+		else if (!voice->down)
+			sound->voice_arrays.dampened[i] = true;
+	}
+}
+
+// only call this from the sound thread
+static void handle_event(SoundThreadData *sound, Event const *event) {
+	switch ((EventType)event->type) {
+	case EVENT_NOTE_ON:
+		note_on(sound, event->channel, event->key, event->vel, event->instrument);
+		break;
+	case EVENT_NOTE_OFF:
+		note_off(sound, event->channel, event->key);
+		break;
+	case EVENT_SUSTAIN:
+		sustain_pedal(sound, event->channel, event->vel != 0);
+		break;
+	}
+}
+
+// sends an event to the sound thread. only call this from the MIDI thread.
+static void send_event(SoundThreadData *sound, EventType type, u8 channel, u8 key, u8 vel, Instrument *inst) {
+	Event event = {
+		.type = (u8)type,
+		.channel = channel,
+		.key = key,
+		.vel = vel,
+		.instrument = inst,
+		.time = time_ns(),
+	};
+	if (inst) __atomic_fetch_add(&inst->voice_refs, 1, __ATOMIC_RELAXED);
+	if (!event_push(&sound->events, &event)) {
+		if (inst) __atomic_fetch_sub(&inst->voice_refs, 1, __ATOMIC_RELAXED);
+		warn("Too many MIDI events at once; dropping some.");
+	}
+}
+
+// writes the header of a 16-bit stereo WAV file with data_size bytes of samples
+static void write_wav_header(FILE *fp, u32 sample_rate, u32 data_size) {
+	fwrite("RIFF", 1, 4, fp);
+	write_u32(fp, data_size + 36); // RIFF chunk size
+	fwrite("WAVE", 1, 4, fp);
+	fwrite("fmt ", 1, 4, fp);
+	write_u32(fp, 16); // fmt  chunk size
+	write_u16(fp, 1); // sample rate
+	write_u16(fp, 2); // channels
+	write_u32(fp, sample_rate); // sample rate
+	write_u32(fp, sample_rate * 4); // byte rate (e.g. 44100 samples / sec * 2 bytes / sample * 2 channels)
+	write_u16(fp, 4); // block align (2 channels * 2 bytes per sample)
+	write_u16(fp, 16); // bits per sample
+	fwrite("data", 1, 4, fp);
+	write_u32(fp, data_size);
+}
+
+static void finish_wav(SoundThreadData *sound, bool lock) {
+	if (lock) pthread_mutex_lock(&sound->output_mutex);
+	assert(sound->out_wav);
+	u32 data_chunk_size = sound->out_wav_nframes == U32_MAX ? U32_MAX : sound->out_wav_nframes * 4;
+
+	char filename[32] = {0};
+	for (u32 i = 1;;++i) {
+		snprintf(filename, sizeof filename-1, "out-%02d.wav", i);
+		struct stat statbuf = {0};
+		if (stat(filename, &statbuf) < 0) {
+			if (errno == ENOENT) {
+				break;
+			} else {
+				warn("stat failed not stopping.");
 				return;
 			}
 		}
 	}
-	printf("Saving to %s... ", filename); fflush(stdout);
+	printf("Saving to %s... ", filename); fflush(stdout);
+
+	FILE *fp = fopen(filename, "wb");
+	write_wav_header(fp, sound->sample_rate, data_chunk_size);
+	fwrite(sound->out_wav_data, 1, data_chunk_size, fp);
+	fclose(fp);
+
+	printf("Saved!\n");
+
+	sound->out_wav_data = mremap(sound->out_wav_data, sound->out_wav_data_npages * page_size, page_size << 14,
+		MREMAP_MAYMOVE);
+	sound->out_wav = false;
+	sound->out_wav_data_npages = 1ul<<14;
+	sound->out_wav_nframes = 0;
+
+	if (lock) pthread_mutex_unlock(&sound->output_mutex);
+}
+
+
+// updates the envelopes of voices[0..nvoices) for count frames, and works out their gains.
+// this does the same thing for every voice, so it's done for all of them at once (it vectorizes well).
+static void update_voice_gains(SoundThreadData *sound, u32 count) {
+	VoiceArrays *va = &sound->voice_arrays;
+	if (sound->release_rate != sound->sample_rate) {
+		for (u32 b = 0; b < 32; ++b)
+			sound->release_factors[b] = powf(0.05f, (float)((u64)1 << b) / (float)sound->sample_rate);
+		sound->release_rate = sound->sample_rate;
+	}
+	// = 0.05^(count / sample_rate), without calling powf every time. the product is rounded differently from powf,
+	// so it can be a few ulps off (which can change samples by 1 compared to using powf here).
+	float release = 1.0f;
+	for (u32 b = 0, c = count; c; ++b, c >>= 1)
+		if (c & 1) release *= sound->release_factors[b];
+	u32 nvoices = sound->nvoices;
+	for (u32 i = 0; i < nvoices; ++i) {
+		va->dampening[i] *= va->dampened[i] ? release : 1.0f;
+		// (the dampening needs to be applied always, in case we get note off then sustain pedal off)
+		float volume = va->level[i] * va->dampening[i];
+		//volume /= 32767.0f; // turn 16-bit signed samples into floating point
+		volume /= MAX_SIMULTANEOUS_NOTES;
+		va->gain_L[i] = volume * va->zone_gain_L[i];
+		va->gain_R[i] = volume * va->zone_gain_R[i];
+	}
+}
+
+// mixes count frames of voices[v] into frames_L/R. returns true if the voice is done.
+// if frames_L and frames_R are NULL, this just moves the voice along as if it had been mixed.
+// this doesn't touch any other voices, so different voices can be rendered on different threads.
+// update_voice_gains must be called first.
+static bool render_voice(SoundThreadData *sound, u32 v, float *frames_L, float *frames_R, u32 count) {
+	VoiceArrays *va = &sound->voice_arrays;
+	Voice *voice = &sound->voices[v];
+	bool done = false;
+	Zone *zone = voice->zone;
+	Samples *samples_L = zone->samples_L;
+	Samples *samples_R = zone->samples_R;
+	i16 const *in_L = va->data_L[v];
+	i16 const *in_R = va->data_R[v];
+	u64 phase = va->phase[v], inc = va->phase_inc[v];
+	Stream *stream = voice->stream;
+
+	u32 sample_frames = samples_L->count;
+	u32 resident = samples_L->resident < samples_R->resident ? samples_L->resident : samples_R->resident;
+	u32 streamed = stream ? __atomic_load_n(&stream->write_pos, __ATOMIC_ACQUIRE) : 0;
+	bool starved = false;
+	bool looping = zone->loop_mode == LOOP_CONTINUOUS
+		|| (zone->loop_mode == LOOP_UNTIL_RELEASE && !va->dampened[v]);
+	if ((phase >> 32) >= sample_frames)
+		return true;
+	{
+		bool dry = !frames_L;
+		u64 loop_end = (u64)samples_L->loop_end << 32;
+		u64 loop_length = loop_end - ((u64)samples_L->loop_start << 32);
+		float volume_L = va->gain_L[v], volume_R = va->gain_R[v];
+		// samples before this can be mixed with the mix kernel.
+		// we stop one sample short, since the kernel can read one sample past the index.
+		u32 fast_end = looping && samples_L->loop_end < resident ? samples_L->loop_end : resident;
+		u64 fast_end_phase = fast_end > 0 ? (u64)(fast_end - 1) << 32 : 0;
+		u32 k = 0;
+		while (k < count) {
+			while (looping && phase >= loop_end)
+				phase -= loop_length;
+			if (phase < fast_end_phase) {
+				u64 fast_frames = (fast_end_phase - phase - 1) / inc + 1;
+				u32 n = count - k;
+				if (fast_frames < n) n = (u32)fast_frames;
+				if (!dry)
+					va->mix[v](frames_L + k, frames_R + k, in_L, in_R, n, phase, inc, volume_L, volume_R);
+				k += n;
+				phase += n * inc;
+				continue;
+			}
+
+			// near the end of what's in memory (or the loop), go one frame at a time
+			u32 ii = (u32)(phase >> 32);
+			if (ii >= sample_frames) {
+				break;
+			}
+			i16 iL, iR;
+			if (ii < resident) {
+				iL = in_L[ii];
+				iR = in_R[ii];
+			} else if (ii < streamed) {
+				iL = stream->ring_L[ii & (STREAM_RING_SIZE - 1)];
+				iR = (stream->stereo ? stream->ring_R : stream->ring_L)[ii & (STREAM_RING_SIZE - 1)];
+			} else {
+				// the rest of the sample hasn't been read (yet)
+				starved = true;
+				break;
+			}
+			if (!dry) {
+				frames_L[k] += ((float)iL * volume_L);
+				frames_R[k] += ((float)iR * volume_R);
+			}
+			++k;
+			phase += inc;
+		}
+		va->phase[v] = phase;
+	}
+
+	if (stream) {
+		__atomic_store_n(&stream->read_pos, (u32)(phase >> 32), __ATOMIC_RELEASE);
+		__atomic_store_n(&stream->frames_per_sec, (u32)((inc * sound->sample_rate) >> 32), __ATOMIC_RELAXED);
+		if (starved) __atomic_fetch_add(&sound->streamer->underruns, 1, __ATOMIC_RELAXED);
+	} else if (starved) {
+		// nothing's going to read the rest of the sample
+		done = true;
+	}
+	if (!looping && ((phase + inc) >> 32) >= sample_frames) {
+		done = true;
+	}
+	if (va->dampening[v] < 1e-3f) {
+		// inaudible now (looped notes would otherwise play forever)
+		done = true;
+	}
+	return done;
+}
+
+// use up some stack, so that the sound/render threads don't page fault when they grow into it
+static __attribute__((noinline)) void prefault_stack(void) {
+	char stack[1 << 16];
+	memset(stack, 0, sizeof stack);
+	__asm__ volatile("" : : "r"(stack) : "memory");
+}
+
+static inline void cpu_relax(void) {
+#if defined __x86_64__ || defined __i386__
+	__builtin_ia32_pause();
+#endif
+}
+
+static void futex_wait(u32 *addr, u32 expected) {
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static void futex_wake_all(u32 *addr) {
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+}
+
+// render groups of voices for the current job until there are none left
+static void render_groups(SoundThreadData *sound) {
+	RenderPool *pool = &sound->render_pool;
+	while (1) {
+		// (this synchronizes with the sound thread resetting next_group, so we see the rest of the job)
+		u32 g = __atomic_fetch_add(&pool->next_group, 1, __ATOMIC_ACQ_REL);
+		if (g >= pool->ngroups) break;
+		u32 count = pool->count;
+		float *bus_L = &pool->buses[2 * g * pool->bus_stride], *bus_R = bus_L + pool->bus_stride;
+		memset(bus_L, 0, count * sizeof *bus_L);
+		memset(bus_R, 0, count * sizeof *bus_R);
+		for (u32 i = pool->group_starts[g]; i < pool->group_starts[g + 1]; ++i)
+			sound->voices[i].ended = render_voice(sound, i, bus_L, bus_R, count);
+		__atomic_fetch_add(&pool->groups_done, 1, __ATOMIC_RELEASE);
+	}
+}
+
+static void *render_thread(void *vdata) {
+	SoundThreadData *sound = vdata;
+	RenderPool *pool = &sound->render_pool;
+	if (sound->realtime) prefault_stack();
+	u32 generation = 0;
+	while (1) {
+		// jobs usually come in quick succession within a period, so spin for a bit before sleeping
+		u32 spins = 0, g;
+		while ((g = __atomic_load_n(&pool->generation, __ATOMIC_ACQUIRE)) == generation) {
+			if (++spins < RENDER_SPINS) {
+				cpu_relax();
+			} else {
+				__atomic_fetch_add(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+				futex_wait(&pool->generation, generation);
+				__atomic_fetch_sub(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+			}
+		}
+		generation = g;
+		render_groups(sound);
+	}
+	return NULL;
+}
+
+// mixes count frames of every voice into frames_L/R. only call this from the sound thread.
+// if frames_L and frames_R are NULL, the voices are just moved along (see render_voice).
+static void render_voices(SoundThreadData *sound, float *frames_L, float *frames_R, u32 count) {
+	RenderPool *pool = &sound->render_pool;
+	update_voice_gains(sound, count);
+	if (pool->ngroups == 0 || !frames_L) {
+		// (voices can be removed as we go, so i isn't always incremented)
+		for (u32 i = 0; i < sound->nvoices; ) {
+			if (render_voice(sound, i, frames_L, frames_R, count))
+				voice_remove(sound, i);
+			else
+				++i;
+		}
+		return;
+	}
+
+	// the groups only depend on the number of voices, so which thread renders which group doesn't
+	// affect the output
+	u32 nvoices = sound->nvoices, ngroups = pool->ngroups;
+	for (u32 g = 0; g <= ngroups; ++g)
+		pool->group_starts[g] = nvoices * g / ngroups;
+	pool->count = count;
+	__atomic_store_n(&pool->groups_done, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&pool->next_group, 0, __ATOMIC_RELEASE);
+	if (pool->nthreads && nvoices >= MIN_VOICES_PER_RENDER_THREAD * (pool->nthreads + 1)) {
+		__atomic_fetch_add(&pool->generation, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&pool->sleepers, __ATOMIC_SEQ_CST))
+			futex_wake_all(&pool->generation);
+	}
+	render_groups(sound);
+	while (__atomic_load_n(&pool->groups_done, __ATOMIC_ACQUIRE) < ngroups)
+		cpu_relax();
+
+	for (u32 g = 0; g < ngroups; ++g) {
+		float const *bus_L = &pool->buses[2 * g * pool->bus_stride], *bus_R = bus_L + pool->bus_stride;
+		for (u32 f = 0; f < count; ++f) {
+			frames_L[f] += bus_L[f];
+			frames_R[f] += bus_R[f];
+		}
+	}
+	for (u32 i = 0; i < sound->nvoices; ) {
+		if (sound->voices[i].ended)
+			voice_remove(sound, i);
+		else
+			++i;
+	}
+}
+
+// convert a period straight into the sound card's buffer (with SND_PCM_ACCESS_MMAP_INTERLEAVED).
+// returns a negative error code if something went wrong which we couldn't recover from.
+static int write_period_mmap(snd_pcm_t *pcm, SoundStats *stats, float const *frames_L, float const *frames_R, u32 count) {
+	u32 done = 0;
+	while (done < count) {
+		int err = 0;
+		snd_pcm_sframes_t avail = snd_pcm_avail_update(pcm);
+		if (avail < 0) {
+			err = (int)avail;
+		} else if (avail == 0) {
+			if (snd_pcm_state(pcm) == SND_PCM_STATE_PREPARED) {
+				// the buffer is full, so we can start playing
+				err = snd_pcm_start(pcm);
+			} else {
+				err = snd_pcm_wait(pcm, 1000);
+				if (err > 0) err = 0;
+			}
+		} else {
+			snd_pcm_channel_area_t const *areas = NULL;
+			snd_pcm_uframes_t offset = 0, n = count - done;
+			err = snd_pcm_mmap_begin(pcm, &areas, &offset, &n);
+			if (err >= 0) {
+				// (the channels are interleaved, so we only need to look at the first one)
+				i16 *dest = (i16 *)((char *)areas[0].addr + areas[0].first / 8 + offset * areas[0].step / 8);
+				kernels.to_s16(dest, frames_L + done, frames_R + done, (u32)n);
+				snd_pcm_sframes_t committed = snd_pcm_mmap_commit(pcm, offset, n);
+				if (committed < 0)
+					err = (int)committed;
+				else
+					done += (u32)committed;
+			}
+		}
+		if (err == -EPIPE || err == -ESTRPIPE)
+			stats_add(stats->xruns, 1);
+		if (err < 0 && (err = snd_pcm_recover(pcm, err, 0)) < 0)
+			return err;
+	}
+	return 0;
+}
+
+static void *sound_thread(void *vdata) {
+	SoundThreadData *data = vdata;
+	snd_pcm_t *pcm = data->pcm;
+	u32 const nframes = data->period;
+	float *frames_fL = calloc(nframes, sizeof *frames_fL), *frames_fR = calloc(nframes, sizeof *frames_fR);
+	i16 *frames = calloc(nframes * 2 /* 2 channels */, sizeof *frames);
+	if (data->realtime) {
+		prefault_stack();
+		memset(frames, 0, nframes * 2 * sizeof *frames);
+	}
+	u64 period_start = 0; // time_ns() when we started rendering the previous period
+	SoundStats *stats = &data->stats;
+	u64 const period_ns = (u64)nframes * 1000000000 / data->sample_rate;
+
+	while (1) {
+		memset(frames_fL, 0, nframes * sizeof *frames_fL);
+		memset(frames_fR, 0, nframes * sizeof *frames_fR);
+		// apply events at the right frame in the period, rendering up to each one.
+		// this means events are delayed by one period, but the timing between them is kept.
+		EventQueue *queue = &data->events;
+		u32 tail = queue->tail;
+		u32 head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+		u64 now = time_ns();
+		if (!period_start) period_start = now;
+		u32 frame = 0;
+		for (; tail != head; ++tail) {
+			Event const *event = &queue->events[tail & (EVENT_QUEUE_SIZE - 1)];
+			u64 since_start = event->time > period_start ? event->time - period_start : 0;
+			u64 event_frame = since_start * data->sample_rate / 1000000000;
+			if (event_frame >= nframes) event_frame = nframes - 1;
+			if (event_frame > frame) {
+				render_voices(data, frames_fL + frame, frames_fR + frame, (u32)event_frame - frame);
+				frame = (u32)event_frame;
+			}
+			handle_event(data, event);
+			u64 lag = now > event->time ? now - event->time : 0;
+			if (lag < MAX_EVENT_LAG_NS) {
+				stats_add(stats->events, 1);
+				stats_add(stats->event_lag_total_ns, lag);
+				stats_max(stats->event_lag_max_ns, lag);
+			}
+		}
+		__atomic_store_n(&queue->tail, tail, __ATOMIC_RELEASE);
+		render_voices(data, frames_fL + frame, frames_fR + frame, nframes - frame);
+		period_start = now;
+
+		u64 render_ns = time_ns() - now;
+		stats_add(stats->render_hist[stats_bucket(render_ns)], 1);
+		stats_max(stats->render_max_ns, render_ns);
+		if (render_ns > period_ns) stats_add(stats->late, 1);
+		__atomic_store_n(&stats->voices, data->nvoices, __ATOMIC_RELAXED);
+		stats_max(stats->voices_max, data->nvoices);
+		stats_add(stats->periods, 1);
+
+		if (data->mmap_output) {
+			int err = write_period_mmap(pcm, stats, frames_fL, frames_fR, nframes);
+			if (err < 0) {
+				printf("Writing to mmapped buffer failed: %s\n", snd_strerror(err));
+				break;
+			}
+			// (the recording needs its own copy)
+			if (data->out_wav)
+				kernels.to_s16(frames, frames_fL, frames_fR, nframes);
+		} else {
+			kernels.to_s16(frames, frames_fL, frames_fR, nframes);
+			
+			snd_pcm_sframes_t frames_written = snd_pcm_writei(pcm, frames, nframes);
+			if (frames_written == -EPIPE || frames_written == -ESTRPIPE)
+				stats_add(stats->xruns, 1);
+			if (frames_written < 0)
+				frames_written = snd_pcm_recover(pcm, (int)frames_written, 0);
+			if (frames_written < 0) {
+				printf("snd_pcm_writei failed: %s\n", snd_strerror((int)frames_written));
+				break;
+			}
+			if (frames_written > 0 && frames_written < (snd_pcm_sframes_t)nframes) {
+				printf("Short write (expected %u, wrote %ld)\n", nframes, (long)frames_written);
+			}
+		}
+
+
+		if (data->out_wav) {
+			u64 old_data_len = (u64)data->out_wav_nframes * 2 /* channels */ * sizeof *frames;
+			u64 new_data_len = old_data_len + nframes * 2 * sizeof *frames; 
+			u64 curr_alloc_size = data->out_wav_data_npages * page_size;
+
+			pthread_mutex_lock(&data->output_mutex);
+			if (new_data_len >= U32_MAX - 100 /* to be safe */) {
+				printf("Cutting off recording (file too large for WAV format).\n");
+				finish_wav(data, false);
+			} else {
+				if (new_data_len > curr_alloc_size) {
+					size_t additional_pages = 1ul<<14;
+					size_t new_size = curr_alloc_size + page_size * additional_pages; // 64 MB on typical systems
+					data->out_wav_data = mremap(data->out_wav_data, curr_alloc_size, new_size,
+						MREMAP_MAYMOVE);
+					data->out_wav_data_npages += additional_pages;
+				}
+
+				memcpy((char *)data->out_wav_data + old_data_len,
+					frames, nframes * 2 * sizeof *frames);
+				data->out_wav_nframes += nframes;
+			}
+			pthread_mutex_unlock(&data->output_mutex);
+		}
+	}
+	free(frames_fL);
+	free(frames_fR);
+	free(frames);
+	return NULL;
+}
+
+#define BENCH_PERIOD 441 // the default period size
+// how many voices can each set of mixing kernels handle per core?
+static void bench_mix(void) {
+	u32 const nsamples = 1u << 20;
+	u32 const nvoices = 64;
+	i16 *samples = malloc(nsamples * sizeof *samples);
+	u32 rng = 12345;
+	for (u32 i = 0; i < nsamples; ++i) {
+		rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+		samples[i] = (i16)(rng >> 16);
+	}
+	u64 incs[64], phases[64];
+	for (u32 v = 0; v < nvoices; ++v) {
+		// every 8th voice plays at the sample's own pitch, the rest are spread over two octaves
+		incs[v] = phase_increment(44100, 44100, v % 8 == 0 ? 0 : ((i32)(v % 25) - 12) * 100);
+	}
+	float out_L[BENCH_PERIOD], out_R[BENCH_PERIOD];
+	i16 out[2 * BENCH_PERIOD];
+	double const period_ns = 1e9 * BENCH_PERIOD / 44100.0;
+	double scalar_ns = 0;
+	volatile i16 sink = 0;
+	printf("Mixing %u voices, %u frames per period at 44.1 kHz:\n", (unsigned)nvoices, (unsigned)BENCH_PERIOD);
+	for (int i = (int)arr_count(all_kernels) - 1; i >= 0; --i) {
+		Kernels const *k = &all_kernels[i];
+		if (!kernels_supported(k)) continue;
+		for (u32 v = 0; v < nvoices; ++v) phases[v] = 0;
+		u64 mix_ns = 0, convert_ns = 0, periods = 0;
+		while (mix_ns + convert_ns < 500000000) {
+			memset(out_L, 0, sizeof out_L);
+			memset(out_R, 0, sizeof out_R);
+			u64 start = time_ns();
+			for (u32 v = 0; v < nvoices; ++v) {
+				// odd voices are stereo
+				i16 const *in_L = samples, *in_R = v % 2 ? samples + nsamples / 2 : samples;
+				if (((phases[v] + BENCH_PERIOD * incs[v]) >> 32) + 2 >= nsamples / 2)
+					phases[v] = 0;
+				k->mix[v % 2 == 0][incs[v] == (u64)1 << 32](out_L, out_R, in_L, in_R, BENCH_PERIOD, phases[v], incs[v], 0.001f, 0.001f);
+				phases[v] += BENCH_PERIOD * incs[v];
+			}
+			u64 mixed = time_ns();
+			k->to_s16(out, out_L, out_R, BENCH_PERIOD);
+			convert_ns += time_ns() - mixed;
+			mix_ns += mixed - start;
+			sink = out[periods % (2 * BENCH_PERIOD)];
+			++periods;
+		}
+		double ns_per_voice = (double)mix_ns / (double)(periods * nvoices);
+		if (strcmp(k->name, "scalar") == 0) scalar_ns = ns_per_voice;
+		printf("%-8s %8.1f ns per voice per period, %6.0f voices per core (%.2fx scalar), convert %.1f ns per period\n",
+			k->name, ns_per_voice, period_ns / ns_per_voice, scalar_ns / ns_per_voice,
+			(double)convert_ns / (double)periods);
+	}
+	(void)sink;
+	printf("Using %s.\n", kernels.name);
+	free(samples);
+}
+
+// how long does render_voices take with different numbers of voices?
+static void bench_voices(void) {
+	u32 const nsamples = 1u << 18;
+	i16 *data = malloc(2 * nsamples * sizeof *data);
+	u32 rng = 12345;
+	for (u32 i = 0; i < 2 * nsamples; ++i) {
+		rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+		data[i] = (i16)(rng >> 16);
+	}
+	// looping, so that the voices never end
+	Samples samples_L = {.count = nsamples, .resident = nsamples, .sample_rate = 44100,
+		.loop_start = 1000, .loop_end = nsamples - 1000, .data = data};
+	Samples samples_R = samples_L;
+	samples_R.data = data + nsamples;
+	Zone mono = {.samples_L = &samples_L, .samples_R = &samples_L, .loop_mode = LOOP_CONTINUOUS,
+		.root_key = 60, .scale_tuning = 100, .gain_L = 0.5f, .gain_R = 0.5f};
+	Zone stereo = mono;
+	stereo.samples_R = &samples_R;
+	Instrument inst = {0};
+	SoundThreadData *sound = aligned_alloc(64, sizeof *sound);
+	float out_L[BENCH_PERIOD], out_R[BENCH_PERIOD];
+	double const period_ns = 1e9 * BENCH_PERIOD / 44100.0;
+	u32 const counts[] = {32, 128, 512};
+	printf("Rendering voices (%s kernels), %u frames per period at 44.1 kHz:\n", kernels.name, (unsigned)BENCH_PERIOD);
+	for (size_t c = 0; c < arr_count(counts); ++c) {
+		memset(sound, 0, sizeof *sound);
+		sound->sample_rate = 44100;
+		sound->polyphony = MAX_POLYPHONY;
+		for (u32 v = 0; v < counts[c]; ++v) {
+			// every 8th voice plays at the sample's own pitch
+			u8 key = v % 8 == 0 ? 60 : (u8)(36 + (v / 16) % 48);
+			// (each voice gets its own channel and key, so that none of them replace each other)
+			u32 i = voice_start(sound, (u8)(v % 16), (u8)(v / 16));
+			voice_init(sound, i, &inst, v % 2 ? &stereo : &mono, key, 100);
+			// some released voices, so that the envelopes have something to do
+			if (v % 4 == 3) sound->voice_arrays.dampened[i] = true;
+		}
+		u64 render_ns = 0, periods = 0;
+		while (render_ns < 300000000) {
+			memset(out_L, 0, sizeof out_L);
+			memset(out_R, 0, sizeof out_R);
+			u64 start = time_ns();
+			render_voices(sound, out_L, out_R, BENCH_PERIOD);
+			render_ns += time_ns() - start;
+			++periods;
+			// keep the released voices from fading out
+			for (u32 i = 0; i < sound->nvoices; ++i)
+				sound->voice_arrays.dampening[i] = 1.0f;
+		}
+		double ns_per_period = (double)render_ns / (double)periods;
+		printf("%4u voices: %9.1f ns per period (%5.1f%% of a period), %6.1f ns per voice\n",
+			(unsigned)sound->nvoices, ns_per_period, 100.0 * ns_per_period / period_ns, ns_per_period / sound->nvoices);
+	}
+	free(sound);
+	free(data);
+}
+
+
+// starts a thread which needs to keep up with the sound card (with SCHED_FIFO priority if realtime,
+// and only on the given CPU if it's not -1). returns 0 or an error code from pthread_create.
+static int create_audio_thread(pthread_t *thread, void *(*fn)(void *), void *arg, bool realtime, int cpu) {
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	if (realtime) {
+		struct sched_param param = {.sched_priority = sched_get_priority_max(SCHED_FIFO) - 10};
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		pthread_attr_setschedparam(&attr, &param);
+	}
+	if (cpu >= 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET((size_t)cpu, &cpus);
+		pthread_attr_setaffinity_np(&attr, sizeof cpus, &cpus);
+	}
+	int err = pthread_create(thread, &attr, fn, arg);
+	if (err == EPERM && realtime) {
+		// (you need CAP_SYS_NICE or an rtprio limit for this)
+		warn("Not allowed to use real-time scheduling. Running at normal priority.");
+		pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+		err = pthread_create(thread, &attr, fn, arg);
+	}
+	pthread_attr_destroy(&attr);
+	return err;
+}
+
+// sets up nthreads render threads to help the sound thread mix voices.
+// if deterministic, the output doesn't depend on the number of threads.
+// render thread i runs on CPU first_cpu + 1 + i, if first_cpu isn't -1.
+static void render_pool_init(SoundThreadData *sound, u32 nthreads, bool deterministic, int first_cpu) {
+	RenderPool *pool = &sound->render_pool;
+	if (nthreads == 0 && !deterministic) return;
+	pool->nthreads = nthreads;
+	pool->ngroups = deterministic ? RENDER_GROUPS : nthreads + 1;
+	pool->bus_stride = (sound->period + 15) & ~15u; // keep each bus on its own cache lines
+	size_t buses_size = 2 * pool->ngroups * pool->bus_stride * sizeof *pool->buses;
+	pool->buses = aligned_alloc(64, buses_size);
+	memset(pool->buses, 0, buses_size);
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	for (u32 i = 0; i < nthreads; ++i) {
+		pthread_t thread;
+		int cpu = first_cpu < 0 ? -1 : (int)((first_cpu + 1 + (long)i) % ncpus);
+		int err = create_audio_thread(&thread, render_thread, sound, sound->realtime, cpu);
+		if (err) die("Couldn't create thread (error %d).", err);
+	}
+}
+
+// the shortest time that at least fraction of the periods took to render (or less)
+static u64 stats_percentile(u64 const *hist, u64 count, double fraction) {
+	u64 rank = (u64)ceil(fraction * (double)count), seen = 0;
+	for (u32 b = 0; b < STATS_BUCKETS; ++b) {
+		seen += hist[b];
+		if (seen >= rank && seen) return stats_bucket_max(b);
+	}
+	return stats_bucket_max(STATS_BUCKETS - 1);
+}
+
+// prints a line of stats about the sound thread (this can be called from any thread)
+static void print_stats(FILE *fp, SoundThreadData *sound) {
+	SoundStats *stats = &sound->stats;
+	u64 hist[STATS_BUCKETS];
+	u64 count = 0;
+	for (u32 b = 0; b < STATS_BUCKETS; ++b) {
+		hist[b] = __atomic_load_n(&stats->render_hist[b], __ATOMIC_RELAXED);
+		count += hist[b];
+	}
+	u64 events = __atomic_load_n(&stats->events, __ATOMIC_RELAXED);
+	u64 lag_total = __atomic_load_n(&stats->event_lag_total_ns, __ATOMIC_RELAXED);
+	u64 max_ns = __atomic_load_n(&stats->render_max_ns, __ATOMIC_RELAXED);
+	// (the percentiles are the tops of histogram buckets, which can be a bit more than the real maximum)
+	u64 p50 = stats_percentile(hist, count, 0.5), p99 = stats_percentile(hist, count, 0.99),
+		p999 = stats_percentile(hist, count, 0.999);
+	if (p50 > max_ns) p50 = max_ns;
+	if (p99 > max_ns) p99 = max_ns;
+	if (p999 > max_ns) p999 = max_ns;
+	double period_ms = 1000.0 * sound->period / sound->sample_rate;
+	fprintf(fp, "Stats: %llu periods, %llu xruns, render time p50 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, "
+		"max %.3f ms of %.3f ms (%.0f%% headroom), %llu late, %u voices (max %u), "
+		"MIDI lag mean %.2f ms, max %.2f ms (%llu events, %llu dropped).\n",
+		(unsigned long long)__atomic_load_n(&stats->periods, __ATOMIC_RELAXED),
+		(unsigned long long)__atomic_load_n(&stats->xruns, __ATOMIC_RELAXED),
+		(double)p50 * 1e-6, (double)p99 * 1e-6, (double)p999 * 1e-6,
+		(double)max_ns * 1e-6, period_ms, 100.0 * (1.0 - (double)max_ns * 1e-6 / period_ms),
+		(unsigned long long)__atomic_load_n(&stats->late, __ATOMIC_RELAXED),
+		(unsigned)__atomic_load_n(&stats->voices, __ATOMIC_RELAXED),
+		(unsigned)__atomic_load_n(&stats->voices_max, __ATOMIC_RELAXED),
+		events ? (double)lag_total * 1e-6 / (double)events : 0.0,
+		(double)__atomic_load_n(&stats->event_lag_max_ns, __ATOMIC_RELAXED) * 1e-6,
+		(unsigned long long)events,
+		(unsigned long long)__atomic_load_n(&sound->events.dropped, __ATOMIC_RELAXED));
+	fflush(fp);
+}
+
+typedef struct {
+	SoundThreadData *sound;
+	u32 interval; // seconds between stats (0 = only on SIGUSR1)
+	char const *filename; // if not NULL, the latest stats are kept in this file instead of being printed
+} StatsThreadData;
+
+// prints stats whenever we get SIGUSR1 (which every other thread blocks), and every data->interval seconds
+static void *stats_thread(void *vdata) {
+	StatsThreadData *data = vdata;
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	while (1) {
+		if (data->interval) {
+			struct timespec timeout = {.tv_sec = data->interval};
+			if (sigtimedwait(&set, NULL, &timeout) < 0 && errno != EAGAIN)
+				continue;
+		} else {
+			int sig = 0;
+			if (sigwait(&set, &sig) != 0)
+				continue;
+		}
+		if (!data->filename) {
+			print_stats(stdout, data->sound);
+			continue;
+		}
+		// (write a new file and rename it, so that whatever's reading it never sees half of it)
+		char tmp_filename[4096];
+		snprintf(tmp_filename, sizeof tmp_filename, "%s.tmp", data->filename);
+		FILE *fp = fopen(tmp_filename, "w");
+		if (!fp) {
+			warn("Couldn't write %s: %s.", tmp_filename, strerror(errno));
+			continue;
+		}
+		print_stats(fp, data->sound);
+		if (fclose(fp) != 0 || rename(tmp_filename, data->filename) != 0)
+			warn("Couldn't write %s: %s.", data->filename, strerror(errno));
+	}
+	return NULL;
+}
+
+static SoundThreadData sound_thread_data;
+
+static bool preset_uses_instrument(SoundFont *sound_font, Preset *preset, Instrument *inst) {
+	PresetZone *zone = &sound_font->preset_zones[preset->first_zone];
+	for (u32 i = 0; i < preset->nzones; ++i, ++zone) {
+		if (&sound_font->insts[zone->inst] == inst)
+			return true;
+	}
+	return false;
+}
+
+static bool instrument_in_use(SoundThreadData *sound, SoundFont *sound_font, Instrument *inst) {
+	for (int c = 0; c < 16; ++c) {
+		if (preset_uses_instrument(sound_font, sound->channels[c], inst))
+			return true;
+	}
+	// (this includes notes which have been sent to the sound thread, but haven't started yet)
+	return __atomic_load_n(&inst->voice_refs, __ATOMIC_ACQUIRE) > 0;
+}
+
+// loads inst if it isn't loaded. only call this from the MIDI thread.
+static void use_instrument(SoundFont *sound_font, Instrument *inst) {
+	inst->last_used = time_ns();
+	if (!inst->zone_samples) {
+		// no one can be using this instrument yet, so we don't need to lock
+		load_instrument(sound_font, inst);
+	}
+}
+
+// loads all of preset's instruments. returns false if none of them have any samples.
+static bool use_preset(SoundFont *sound_font, Preset *preset) {
+	bool any_loaded = false;
+	PresetZone *zone = &sound_font->preset_zones[preset->first_zone];
+	for (u32 i = 0; i < preset->nzones; ++i, ++zone) {
+		Instrument *inst = &sound_font->insts[zone->inst];
+		use_instrument(sound_font, inst);
+		any_loaded |= inst->samples_loaded;
+	}
+	return any_loaded;
+}
+
+// unloads the least recently used instruments which aren't being played
+// until at most memory_budget bytes of samples are loaded (0 = no limit).
+// only call this from the MIDI thread.
+static void evict_instruments(SoundThreadData *sound, SoundFont *sound_font, u64 memory_budget) {
+	while (memory_budget && sound_font->sample_bytes_allocated > memory_budget) {
+		Instrument *lru = NULL;
+		for (u32 i = 0; i + 1 < sound_font->ninsts; ++i) {
+			Instrument *other = &sound_font->insts[i];
+			if (!other->zone_samples) continue;
+			if (lru && other->last_used >= lru->last_used) continue;
+			if (instrument_in_use(sound, sound_font, other)) continue;
+			lru = other;
+		}
+		if (lru) unload_instrument(sound_font, lru);
+		if (!lru) break; // everything that's loaded is being used
+	}
+}
+
+typedef struct {
+	SoundFont *sound_font;
+	u32 next_inst; // next instrument to load (atomic)
+	u64 cpu_ns; // total CPU time spent loading instruments, across all threads (atomic)
+} PreloadJob;
+
+static void *preload_thread(void *vjob) {
+	PreloadJob *job = vjob;
+	SoundFont *sound_font = job->sound_font;
+	u64 start = thread_cpu_ns();
+	while (1) {
+		u32 i = __atomic_fetch_add(&job->next_inst, 1, __ATOMIC_RELAXED);
+		if (i + 1 >= sound_font->ninsts) break; // last instrument is EOI
+		load_instrument(sound_font, &sound_font->insts[i]);
+	}
+	__atomic_fetch_add(&job->cpu_ns, thread_cpu_ns() - start, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+// loads every instrument, using nthreads threads
+static void preload_instruments(SoundFont *sound_font, u32 nthreads) {
+	PreloadJob job = {0};
+	job.sound_font = sound_font;
+	pthread_t *threads = calloc(nthreads, sizeof *threads);
+	u64 start = time_ns();
+	u32 nstarted = 0;
+	for (u32 t = 1; t < nthreads; ++t) {
+		if (pthread_create(&threads[nstarted], NULL, preload_thread, &job) == 0)
+			++nstarted;
+	}
+	preload_thread(&job); // this thread does some of the work too
+	for (u32 t = 0; t < nstarted; ++t)
+		pthread_join(threads[t], NULL);
+	u64 wall_ns = time_ns() - start;
+	free(threads);
+	// (time spent waiting for the disk doesn't count as CPU time, so this isn't a speedup over one thread)
+	printf("Preloaded %u instruments on %u threads in %.1f ms (%.1f ms of CPU time, %.2fx the wall time).\n",
+		(unsigned)sound_font->ninsts - 1, (unsigned)nstarted + 1, (double)wall_ns * 1e-6, (double)job.cpu_ns * 1e-6,
+		wall_ns ? (double)job.cpu_ns / (double)wall_ns : 0.0);
+}
+
+// parses the soundfont over and over again (for at least a second), and works out how long it takes
+static void time_sound_font_parse(FILE *fp, u32 *nruns, u64 *best, u64 *total) {
+	u32 const min_runs = 5;
+	u64 const min_ns = 1000000000;
+	u64 total_ns = 0, best_ns = UINT64_MAX;
+	u32 runs;
+	for (runs = 0; runs < min_runs || total_ns < min_ns; ++runs) {
+		SoundFont sound_font = {0};
+		fseeko(fp, 0, SEEK_SET);
+		u64 start = time_ns();
+		read_sound_font(fp, &sound_font, false);
+		u64 elapsed = time_ns() - start;
+		total_ns += elapsed;
+		if (elapsed < best_ns) best_ns = elapsed;
+		free_sound_font(&sound_font);
+	}
+	*nruns = runs;
+	*best = best_ns;
+	*total = total_ns;
+}
+
+// parses the soundfont over and over again, and reports how long it takes
+static void bench_parse(FILE *fp) {
+	u32 runs;
+	u64 best_ns, total_ns;
+	time_sound_font_parse(fp, &runs, &best_ns, &total_ns);
+	printf("Parsed soundfont %u times: best %.3f ms, average %.3f ms.\n", (unsigned)runs,
+		(double)best_ns * 1e-6, (double)total_ns * 1e-6 / runs);
+}
+
+static void write_chunk_header(FILE *fp, char const *id, u32 size) {
+	fwrite(id, 1, 4, fp);
+	write_u32(fp, size);
+}
+
+static void write_name(FILE *fp, char const *fmt, u32 i) {
+	char name[20] = {0};
+	snprintf(name, sizeof name, fmt, (unsigned)i);
+	fwrite(name, 1, sizeof name, fp);
+}
+
+static void write_gen(FILE *fp, u16 oper, u16 amount) {
+	write_u16(fp, oper);
+	write_u16(fp, amount);
+}
+
+/*
+	Writes a soundfont with ninsts instruments (and a preset for each one), which each split the keyboard
+	into nsplits zones. Even instruments have stereo samples, and odd ones mono samples. Every zone has
+	its own looped noise sample of sample_frames frames at 44.1 kHz, with root key 60.
+*/
+static void write_synthetic_sound_font(FILE *fp, u32 ninsts, u32 nsplits, u32 sample_frames) {
+	u32 const sample_gap = 46; // the spec wants (at least) 46 zero samples after each sample
+	u32 ngen_zones = 0, ngens = 0;
+	for (u32 i = 0; i < ninsts; ++i) {
+		u32 channels = i % 2 ? 1 : 2;
+		ngen_zones += channels * nsplits;
+		ngens += (channels == 2 ? 5 : 4) * channels * nsplits;
+	}
+	u32 nsamples = ngen_zones; // (one for each generator zone)
+	u32 smpl_size = nsamples * (sample_frames + sample_gap) * 2;
+	u32 info_size = 4 + 8 + 4;
+	u32 sdta_size = 4 + 8 + smpl_size;
+	u32 pdta_size = 4 + 9 * 8 + 38 * (ninsts + 1) + 4 * (ninsts + 1) + 10 + 4 * (ninsts + 1)
+		+ 22 * (ninsts + 1) + 4 * (ngen_zones + 1) + 10 + 4 * (ngens + 1) + 46 * (nsamples + 1);
+	write_chunk_header(fp, "RIFF", 4 + (8 + info_size) + (8 + sdta_size) + (8 + pdta_size));
+	fwrite("sfbk", 1, 4, fp);
+
+	write_chunk_header(fp, "LIST", info_size);
+	fwrite("INFO", 1, 4, fp);
+	write_chunk_header(fp, "ifil", 4);
+	write_u16(fp, 2);
+	write_u16(fp, 1);
+
+	write_chunk_header(fp, "LIST", sdta_size);
+	fwrite("sdta", 1, 4, fp);
+	write_chunk_header(fp, "smpl", smpl_size);
+	i16 *data = calloc(sample_frames + sample_gap, sizeof *data);
+	u32 rng = 12345;
+	for (u32 i = 0; i < nsamples; ++i) {
+		for (u32 f = 0; f < sample_frames; ++f) {
+			rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+			data[f] = (i16)(rng >> 16);
+		}
+		fwrite(data, sizeof *data, sample_frames + sample_gap, fp);
+	}
+	free(data);
+
+	write_chunk_header(fp, "LIST", pdta_size);
+	fwrite("pdta", 1, 4, fp);
+	write_chunk_header(fp, "phdr", 38 * (ninsts + 1));
+	for (u32 i = 0; i <= ninsts; ++i) {
+		write_name(fp, i < ninsts ? "Preset %u" : "EOP", i);
+		write_u16(fp, (u16)(i % 128)); // program
+		write_u16(fp, (u16)(i / 128)); // bank
+		write_u16(fp, (u16)i); // bag
+		write_u32(fp, 0);
+		write_u32(fp, 0);
+		write_u32(fp, 0);
+	}
+	write_chunk_header(fp, "pbag", 4 * (ninsts + 1));
+	for (u32 i = 0; i <= ninsts; ++i) {
+		write_u16(fp, (u16)i);
+		write_u16(fp, 0);
+	}
+	write_chunk_header(fp, "pmod", 10);
+	for (u32 i = 0; i < 5; ++i) write_u16(fp, 0);
+	write_chunk_header(fp, "pgen", 4 * (ninsts + 1));
+	for (u32 i = 0; i < ninsts; ++i)
+		write_gen(fp, GEN_instrument, (u16)i);
+	write_gen(fp, 0, 0);
+
+	write_chunk_header(fp, "inst", 22 * (ninsts + 1));
+	u32 bag = 0;
+	for (u32 i = 0; i <= ninsts; ++i) {
+		write_name(fp, i < ninsts ? "Instrument %u" : "EOI", i);
+		write_u16(fp, (u16)bag);
+		bag += (i % 2 ? 1 : 2) * nsplits;
+	}
+	write_chunk_header(fp, "ibag", 4 * (ngen_zones + 1));
+	u32 gen = 0;
+	for (u32 i = 0; i < ninsts; ++i) {
+		u32 channels = i % 2 ? 1 : 2;
+		for (u32 z = 0; z < channels * nsplits; ++z) {
+			write_u16(fp, (u16)gen);
+			write_u16(fp, 0);
+			gen += channels == 2 ? 5 : 4;
+		}
+	}
+	write_u16(fp, (u16)gen);
+	write_u16(fp, 0);
+	write_chunk_header(fp, "imod", 10);
+	for (u32 i = 0; i < 5; ++i) write_u16(fp, 0);
+	write_chunk_header(fp, "igen", 4 * (ngens + 1));
+	u32 sample = 0;
+	for (u32 i = 0; i < ninsts; ++i) {
+		u32 channels = i % 2 ? 1 : 2;
+		for (u32 z = 0; z < nsplits; ++z) {
+			u8 lo = (u8)(128 * z / nsplits), hi = (u8)(128 * (z + 1) / nsplits - 1);
+			for (u32 c = 0; c < channels; ++c) {
+				write_gen(fp, GEN_keyRange, (u16)(lo | hi << 8));
+				if (channels == 2) write_gen(fp, GEN_pan, (u16)(c ? 500 : -500));
+				write_gen(fp, GEN_overridingRootKey, 60);
+				write_gen(fp, GEN_sampleModes, LOOP_CONTINUOUS);
+				write_gen(fp, GEN_sampleID, (u16)sample++);
+			}
+		}
+	}
+	write_gen(fp, 0, 0);
+	write_chunk_header(fp, "shdr", 46 * (nsamples + 1));
+	for (u32 i = 0; i <= nsamples; ++i) {
+		write_name(fp, i < nsamples ? "Sample %u" : "EOS", i);
+		u32 start = i < nsamples ? i * (sample_frames + sample_gap) : 0;
+		write_u32(fp, start);
+		write_u32(fp, i < nsamples ? start + sample_frames : 0);
+		write_u32(fp, i < nsamples ? start + sample_frames / 16 : 0);
+		write_u32(fp, i < nsamples ? start + sample_frames - sample_frames / 16 : 0);
+		write_u32(fp, 44100);
+		fputc(60, fp); // pitch
+		fputc(0, fp); // pitch correction
+		write_u16(fp, 0); // sample link
+		write_u16(fp, 1); // mono
+	}
+}
 
-	FILE *fp = fopen(filename, "wb");
-	fwrite("RIFF", 1, 4, fp);
-	write_u32(fp, riff_chunk_size);
-	fwrite("WAVE", 1, 4, fp);
-	fwrite("fmt ", 1, 4, fp);
-	write_u32(fp, 16); // fmt  chunk size
-	write_u16(fp, 1); // sample rate
-	write_u16(fp, 2); // channels
-	u32 sample_rate = sound->sample_rate;
-	write_u32(fp, sample_rate); // sample rate
-	write_u32(fp, sample_rate * 4); // byte rate (e.g. 44100 samples / sec * 2 bytes / sample * 2 channels)
-	write_u16(fp, 4); // block align (2 channels * 2 bytes per sample)
-	write_u16(fp, 16); // bits per sample
-	fwrite("data", 1, 4, fp);
-	write_u32(fp, data_chunk_size);
-	fwrite(sound->out_wav_data, 1, data_chunk_size, fp);
+// puts a synthetic soundfont (see write_synthetic_sound_font) in an in-memory file
+static FILE *synthetic_sound_font(u32 ninsts, u32 nsplits, u32 sample_frames) {
+	int fd = memfd_create("smidi-bench.sf2", 0);
+	FILE *fp = fd >= 0 ? fdopen(fd, "w+b") : tmpfile();
+	if (!fp) die("Couldn't create a file for the benchmark soundfont: %s.", strerror(errno));
+	write_synthetic_sound_font(fp, ninsts, nsplits, sample_frames);
+	if (fflush(fp) != 0) die("Couldn't write the benchmark soundfont: %s.", strerror(errno));
+	fseeko(fp, 0, SEEK_SET);
+	return fp;
+}
+
+// how many periods are timed at once by bench_suite
+#define BENCH_BATCH 64
+
+// how long rendering count voices of inst at pitch ratio 2^(semitones/12) with the current kernels takes,
+// in ns per frame
+static double time_render(SoundThreadData *sound, Instrument *inst, u32 count, i32 semitones, u32 period,
+	float *out_L, float *out_R) {
+	memset(sound, 0, sizeof *sound);
+	sound->sample_rate = 44100;
+	sound->polyphony = MAX_POLYPHONY;
+	u8 key = (u8)(60 + semitones);
+	Zone *zone = instrument_zone(inst, key, 100);
+	for (u32 v = 0; v < count; ++v) {
+		// (each voice gets its own channel and key, so that none of them replace each other)
+		u32 i = voice_start(sound, (u8)(v % 16), (u8)(v / 16));
+		voice_init(sound, i, inst, zone, key, 100);
+		// some released voices, so that the envelopes have something to do
+		if (v % 4 == 3) sound->voice_arrays.dampened[i] = true;
+	}
+	u64 render_ns = 0, periods = 0;
+	while (render_ns < 20000000) {
+		// (time BENCH_BATCH periods at once, so that reading the clock doesn't get counted)
+		u64 start = time_ns();
+		for (u32 b = 0; b < BENCH_BATCH; ++b) {
+			memset(out_L, 0, period * sizeof *out_L);
+			memset(out_R, 0, period * sizeof *out_R);
+			render_voices(sound, out_L, out_R, period);
+			// keep the released voices from fading out
+			for (u32 i = 0; i < sound->nvoices; ++i)
+				sound->voice_arrays.dampening[i] = 1.0f;
+		}
+		render_ns += time_ns() - start;
+		periods += BENCH_BATCH;
+	}
+	return (double)render_ns / (double)(periods * period);
+}
+
+/*
+	Benchmarks parsing, loading instruments, rendering and converting to S16 with synthetic soundfonts
+	(so that it runs anywhere), and prints the results as JSON, so that builds can be compared.
+	This is what make bench runs.
+*/
+static void bench_suite(void) {
+	u32 const ninsts = 128, nsplits = 8, sample_frames = 8192;
+	FILE *fp = synthetic_sound_font(ninsts, nsplits, sample_frames);
+	printf("{\n");
+	printf("\t\"sample_rate\": 44100,\n");
+	printf("\t\"kernels\": \"%s\",\n", kernels.name);
+	{
+		u32 runs;
+		u64 best_ns, total_ns;
+		time_sound_font_parse(fp, &runs, &best_ns, &total_ns);
+		printf("\t\"parse\": {\"instruments\": %u, \"zones_per_instrument\": %u, \"runs\": %u, "
+			"\"best_ns\": %llu, \"mean_ns\": %.0f},\n", (unsigned)ninsts, (unsigned)nsplits, (unsigned)runs,
+			(unsigned long long)best_ns, (double)total_ns / runs);
+	}
+
+	SoundFont sound_font = {0};
+	fseeko(fp, 0, SEEK_SET);
+	read_sound_font(fp, &sound_font, false);
+	{
+		u32 runs;
+		u64 total_ns = 0, best_ns = UINT64_MAX, sample_bytes = 0, table_bytes = 0;
+		for (runs = 0; runs < 5 || total_ns < 500000000; ++runs) {
+			u64 start = time_ns();
+			for (u32 i = 0; i + 1 < sound_font.ninsts; ++i)
+				load_instrument(&sound_font, &sound_font.insts[i]);
+			u64 elapsed = time_ns() - start;
+			total_ns += elapsed;
+			if (elapsed < best_ns) best_ns = elapsed;
+			sample_bytes = sound_font.sample_bytes_allocated;
+			table_bytes = 0;
+			for (u32 i = 0; i + 1 < sound_font.ninsts; ++i) {
+				Instrument *inst = &sound_font.insts[i];
+				table_bytes += 128 * 128 * sizeof *inst->zone_table + inst->nzones * sizeof *inst->zones
+					+ inst->ngen_zones * sizeof *inst->zone_samples;
+				unload_instrument(&sound_font, inst);
+			}
+		}
+		printf("\t\"load\": {\"instruments\": %u, \"runs\": %u, \"best_ns\": %llu, \"mean_ns\": %.0f, "
+			"\"ns_per_instrument\": %.0f, \"sample_bytes\": %llu, \"table_bytes\": %llu},\n",
+			(unsigned)ninsts, (unsigned)runs, (unsigned long long)best_ns, (double)total_ns / runs,
+			(double)best_ns / ninsts, (unsigned long long)sample_bytes, (unsigned long long)table_bytes);
+	}
+
+	// instrument 0 has stereo samples, instrument 1 mono ones
+	Instrument *stereo = &sound_font.insts[0], *mono = &sound_font.insts[1];
+	load_instrument(&sound_font, stereo);
+	load_instrument(&sound_font, mono);
+	u32 const voice_counts[] = {1, 32, 128, 512};
+	i32 const semitones[] = {0, -12, 7, 12};
+	u32 const periods[] = {64, 441, 1024};
+	SoundThreadData *sound = aligned_alloc(64, sizeof *sound);
+	float *out_L = calloc(1024, sizeof *out_L), *out_R = calloc(1024, sizeof *out_R);
+	i16 *out = calloc(2 * 1024, sizeof *out);
+	Kernels const selected = kernels;
+	bool first = true;
+	printf("\t\"render\": [\n");
+	for (size_t k = 0; k < arr_count(all_kernels); ++k) {
+		if (!kernels_supported(&all_kernels[k])) continue;
+		kernels = all_kernels[k]; // (voice_init picks the voices' kernels from here)
+		for (size_t c = 0; c < arr_count(voice_counts); ++c)
+		for (size_t s = 0; s < arr_count(semitones); ++s)
+		for (size_t p = 0; p < arr_count(periods); ++p)
+		for (u32 channels = 1; channels <= 2; ++channels) {
+			double ns = time_render(sound, channels == 2 ? stereo : mono, voice_counts[c], semitones[s],
+				periods[p], out_L, out_R);
+			printf("%s\t\t{\"kernels\": \"%s\", \"channels\": %u, \"voices\": %u, \"pitch_ratio\": %.4f, "
+				"\"period\": %u, \"ns_per_frame\": %.2f, \"voices_per_core\": %.0f}", first ? "" : ",\n",
+				kernels.name, (unsigned)channels, (unsigned)voice_counts[c], pow(2.0, semitones[s] / 12.0),
+				(unsigned)periods[p], ns, voice_counts[c] * (1e9 / 44100.0) / ns);
+			first = false;
+		}
+	}
+	printf("\n\t],\n");
+	kernels = selected;
+
+	u32 rng = 12345;
+	for (u32 f = 0; f < 1024; ++f) {
+		// (some of these need clipping)
+		rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+		out_L[f] = (float)(i32)rng * (1.2f / 2147483648.0f);
+		out_R[f] = -out_L[f];
+	}
+	volatile i16 sink = 0;
+	first = true;
+	printf("\t\"to_s16\": [\n");
+	for (size_t k = 0; k < arr_count(all_kernels); ++k) {
+		Kernels const *kern = &all_kernels[k];
+		if (!kernels_supported(kern)) continue;
+		for (size_t p = 0; p < arr_count(periods); ++p) {
+			u64 convert_ns = 0, n = 0;
+			while (convert_ns < 20000000) {
+				u64 start = time_ns();
+				for (u32 b = 0; b < BENCH_BATCH; ++b) {
+					kern->to_s16(out, out_L, out_R, periods[p]);
+					sink = out[(n + b) % periods[p]];
+				}
+				convert_ns += time_ns() - start;
+				n += BENCH_BATCH;
+			}
+			printf("%s\t\t{\"kernels\": \"%s\", \"period\": %u, \"ns_per_frame\": %.3f}", first ? "" : ",\n",
+				kern->name, (unsigned)periods[p], (double)convert_ns / (double)(n * periods[p]));
+			first = false;
+		}
+	}
+	(void)sink;
+	printf("\n\t]\n}\n");
+	free(sound);
+	free(out_L);
+	free(out_R);
+	free(out);
+	unload_instrument(&sound_font, stereo);
+	unload_instrument(&sound_font, mono);
+	free_sound_font(&sound_font);
 	fclose(fp);
+}
 
-	printf("Saved!\n");
+// an event from a MIDI file
+typedef struct {
+	u64 frame; // when it happens (in output frames from the start)
+	u8 status; // e.g. 0x91 = note on, channel 2
+	u8 data1, data2;
+} MidiEvent;
 
-	sound->out_wav_data = mremap(sound->out_wav_data, sound->out_wav_data_npages * page_size, page_size << 14,
-		MREMAP_MAYMOVE);
-	sound->out_wav = false;
-	sound->out_wav_data_npages = 1ul<<14;
-	sound->out_wav_nframes = 0;
+typedef struct {
+	MidiEvent *events; // sorted by frame
+	u32 nevents;
+	u64 length; // frame of the last event
+} MidiFile;
 
-	if (lock) pthread_mutex_unlock(&sound->output_mutex);
+// a MIDI event or tempo change, before its time has been worked out
+typedef struct {
+	u64 tick;
+	u32 order; // where it was in the file, so that events at the same tick stay in order
+	u32 tempo; // microseconds per quarter note, for tempo changes (status = 0xff)
+	MidiEvent event;
+} MidiFileEvent;
+
+static int midi_file_event_cmp(void const *av, void const *bv) {
+	MidiFileEvent const *a = av, *b = bv;
+	if (a->tick != b->tick) return a->tick < b->tick ? -1 : 1;
+	return a->order < b->order ? -1 : a->order > b->order;
 }
 
+// reads a variable-length quantity. returns false if it runs past end.
+static bool midi_read_varlen(u8 const **p, u8 const *end, u32 *value) {
+	u32 x = 0;
+	for (int i = 0; i < 4; ++i) {
+		if (*p >= end) return false;
+		u8 byte = *(*p)++;
+		x = x << 7 | (byte & 0x7f);
+		if (!(byte & 0x80)) {
+			*value = x;
+			return true;
+		}
+	}
+	return false;
+}
 
-#define nframes 441
-static void *sound_thread(void *vdata) {
-	SoundThreadData *data = vdata;
-	snd_pcm_t *pcm = data->pcm;
-	float frames_fL[nframes] = {0.0f}, frames_fR[nframes] = {0.0f};
-	i16 frames[nframes * 2 /* 2 channels */] = {0};
+// reads a standard MIDI file (type 0 or 1), converting event times to frames at sample_rate.
+// only the events smidi does something with (notes, controllers, program changes) are kept.
+// returns false on failure.
+static bool read_midi_file(char const *filename, u32 sample_rate, MidiFile *midi) {
+	memset(midi, 0, sizeof *midi);
+	FILE *fp = fopen(filename, "rb");
+	if (!fp) {
+		warn("Couldn't open %s: %s.", filename, strerror(errno));
+		return false;
+	}
+	fseeko(fp, 0, SEEK_END);
+	size_t size = (size_t)ftello(fp);
+	fseeko(fp, 0, SEEK_SET);
+	u8 *data = malloc(size ? size : 1);
+	bool ok = fread(data, 1, size, fp) == size;
+	fclose(fp);
+	u8 const *p = data, *end = data + size;
+	if (!ok || size < 14 || memcmp(p, "MThd", 4) != 0) {
+		warn("%s isn't a MIDI file.", filename);
+		free(data);
+		return false;
+	}
+	u32 header_size = (u32)p[4] << 24 | (u32)p[5] << 16 | (u32)p[6] << 8 | p[7];
+	u16 format = (u16)(p[8] << 8 | p[9]);
+	u16 division = (u16)(p[12] << 8 | p[13]);
+	if (format > 1) {
+		warn("%s is a type %u MIDI file. Only types 0 and 1 are supported.", filename, format);
+		free(data);
+		return false;
+	}
+	if (header_size > size - 8 || division == 0) {
+		warn("%s has a bad header.", filename);
+		free(data);
+		return false;
+	}
+	p += 8 + header_size;
 
-	while (1) {
-		memset(frames_fL, 0, sizeof frames_fL);
-		memset(frames_fR, 0, sizeof frames_fR);
-		float t_iter = (float)nframes / (float)data->sample_rate;
-		sound_lock(data);
-		Instrument *instrument = data->instrument;
-		u8 n = 0;
-		for (Note *note = data->notes; n < 128; ++note, ++n) {
-			if (!note->exists) continue;
-			Samples *samples_L = instrument->samples[2*n];
-			Samples *samples_R = instrument->samples[2*n+1];
-			if (!samples_L || !samples_R) {
-				die("No samples for %d sorry (%p %p).", n, samples_L, samples_R);
-			}
-			i16 *in_L = samples_L->data;
-			i16 *in_R = samples_R->data;
-			if (samples_R->count != samples_L->count) {
-				warn("Sample count for left channel doesn't match sample count for right channel.");
-				in_R = in_L;
-				samples_R = samples_L;
-				instrument->samples[2*n+1] = instrument->samples[2*n];
+	MidiFileEvent *events = NULL;
+	u32 nevents = 0, capacity = 0;
+	const char *error = NULL;
+	while (!error && end - p >= 8) {
+		u32 chunk_size = (u32)p[4] << 24 | (u32)p[5] << 16 | (u32)p[6] << 8 | p[7];
+		bool track = memcmp(p, "MTrk", 4) == 0;
+		p += 8;
+		if (chunk_size > (size_t)(end - p)) {
+			error = "a chunk goes past the end of the file";
+			break;
+		}
+		u8 const *track_end = p + chunk_size;
+		u64 tick = 0;
+		u8 running_status = 0;
+		while (track && p < track_end) {
+			u32 delta = 0;
+			if (!midi_read_varlen(&p, track_end, &delta) || p >= track_end) {
+				error = "an event goes past the end of its track";
+				break;
 			}
-			u32 pos = note->pos;
-
-			u32 sample_frames = samples_L->count;
-			int pitch_diff = n - samples_L->pitch;
-			float time_multiplier = (float)samples_L->sample_rate / (float)data->sample_rate * powf(2.0f, (float)pitch_diff / 12.0f); // stretch factor of input
-			i64 frames_left_in_sample = (i64)sample_frames - pos;
-			if (frames_left_in_sample <= 0) {
-				note->exists = false;
-				continue;
+			tick += delta;
+			u8 status = *p;
+			if (status & 0x80)
+				++p;
+			else if (running_status)
+				status = running_status;
+			else {
+				error = "data without a status byte";
+				break;
 			}
-			{
-				float *out_L = frames_fL, *out_R = frames_fR;
-				float volume = (float)note->vel / 128.0f;
-				if (note->dampened) {
-					note->dampening *= powf(0.05f, t_iter);
+			MidiFileEvent event = {.tick = tick};
+			if (status == 0xff || status == 0xf0 || status == 0xf7) {
+				// meta or sysex event (these cancel running status)
+				running_status = 0;
+				u8 type = 0;
+				if (status == 0xff) {
+					if (p >= track_end) { error = "truncated meta event"; break; }
+					type = *p++;
+				}
+				u32 length = 0;
+				if (!midi_read_varlen(&p, track_end, &length) || length > (size_t)(track_end - p)) {
+					error = "truncated meta/sysex event";
+					break;
 				}
-				volume *= note->dampening; // this needs to be here always in case we get note off then sustain pedal off
-				float *out_end = frames_fL + nframes;
-				float in_idx = (float)pos;
-				//volume /= 32767.0f; // turn 16-bit signed samples into floating point
-				volume /= MAX_SIMULTANEOUS_NOTES;
-				for (; out_L < out_end; ++out_L, ++out_R, in_idx += time_multiplier) {
-					u32 ii = (u32)in_idx;
-					if (ii >= sample_frames) {
-						break;
-					}
-					i16 iL = in_L[ii];
-					i16 iR = in_R[ii];
-					*out_L += ((float)iL * volume);
-					*out_R += ((float)iR * volume);
+				if (status == 0xff && type == 0x51 && length == 3) {
+					event.tempo = (u32)p[0] << 16 | (u32)p[1] << 8 | p[2];
+					event.event.status = 0xff;
 				}
-				note->pos = (u32)in_idx;
-				
+				p += length;
+				if (status == 0xff && type == 0x2f) break; // end of track
+				if (!event.tempo) continue;
+			} else if (status >= 0xf0) {
+				// system common/real-time messages shouldn't be in MIDI files
+				error = "unexpected system message";
+				break;
+			} else {
+				running_status = status;
+				u32 ndata = (status >> 4) == 0xc || (status >> 4) == 0xd ? 1 : 2;
+				if ((size_t)(track_end - p) < ndata) { error = "truncated event"; break; }
+				event.event.status = status;
+				event.event.data1 = p[0] & 0x7f;
+				if (ndata > 1) event.event.data2 = p[1] & 0x7f;
+				p += ndata;
+				u8 type = status >> 4;
+				if (type != 0x8 && type != 0x9 && type != 0xb && type != 0xc)
+					continue; // pitch bend, aftertouch
 			}
+			if (nevents == capacity) {
+				capacity = capacity ? 2 * capacity : 1024;
+				events = realloc(events, capacity * sizeof *events);
+			}
+			event.order = nevents;
+			events[nevents++] = event;
+		}
+		p = track_end;
+	}
+	free(data);
+	if (error) {
+		warn("Bad MIDI file %s: %s.", filename, error);
+		free(events);
+		return false;
+	}
 
-			if (note->pos + (u32)time_multiplier >= sample_frames) {
-				note->exists = false;
+	// work out when everything happens using the tempo map
+	qsort(events, nevents, sizeof *events, midi_file_event_cmp);
+	midi->events = calloc(nevents ? nevents : 1, sizeof *midi->events);
+	double tempo_us = 500000; // microseconds per quarter note (120 BPM until we're told otherwise)
+	double us_per_tick;
+	if (division & 0x8000) {
+		// SMPTE: frames per second and ticks per frame (tempo doesn't matter)
+		i32 fps = -(i32)(i8)(division >> 8);
+		if (fps == 29) fps = 30; // (drop-frame is really 29.97)
+		us_per_tick = 1e6 / (double)(fps * (division & 0xff));
+	} else {
+		us_per_tick = tempo_us / division;
+	}
+	u64 segment_tick = 0;
+	double segment_us = 0;
+	for (u32 i = 0; i < nevents; ++i) {
+		MidiFileEvent *e = &events[i];
+		double us = segment_us + (double)(e->tick - segment_tick) * us_per_tick;
+		if (e->tempo) {
+			if (!(division & 0x8000)) {
+				segment_tick = e->tick;
+				segment_us = us;
+				us_per_tick = (double)e->tempo / division;
 			}
-			//printf("NOTE: %d\n", note->note);
+			continue;
 		}
-		sound_unlock(data);
+		MidiEvent *event = &midi->events[midi->nevents++];
+		*event = e->event;
+		event->frame = (u64)(us * sample_rate / 1e6);
+		midi->length = event->frame;
+	}
+	free(events);
+	return true;
+}
+
+// the preset a MIDI channel starts out with (General MIDI uses channel 10 for drums)
+static Preset *default_channel_preset(SoundFont *sound_font, u8 channel) {
+	Preset *preset = NULL;
+	if (channel == 9) preset = find_preset(sound_font, 128, 0);
+	if (!preset) preset = find_preset(sound_font, 0, 0);
+	if (!preset) preset = &sound_font->presets[0];
+	return preset;
+}
 
-		for (u32 i = 0; i < nframes; ++i) {
-			frames[2*i] = (i16)frames_fL[i];
-			frames[2*i+1] = (i16)frames_fR[i];
+// loads every preset the MIDI file uses, so that nothing needs to be loaded while it's rendered
+static void use_midi_presets(SoundFont *sound_font, MidiFile const *midi) {
+	u16 bank[16] = {0};
+	bank[9] = 128;
+	for (u8 c = 0; c < 16; ++c)
+		use_preset(sound_font, default_channel_preset(sound_font, c));
+	for (u32 i = 0; i < midi->nevents; ++i) {
+		MidiEvent const *event = &midi->events[i];
+		u8 channel = event->status & 0xf;
+		if ((event->status >> 4) == 0xb && event->data1 == 0 && channel != 9) {
+			bank[channel] = event->data2;
+		} else if ((event->status >> 4) == 0xc) {
+			Preset *preset = find_preset(sound_font, bank[channel], event->data1);
+			if (preset) use_preset(sound_font, preset);
 		}
-		
-		snd_pcm_sframes_t frames_written = snd_pcm_writei(pcm, frames, nframes);
-		if (frames_written < 0)
-			frames_written = snd_pcm_recover(pcm, (int)frames_written, 0);
-		if (frames_written < 0) {
-			printf("snd_pcm_writei failed: %s\n", snd_strerror((int)frames_written));
+	}
+}
+
+// after the last event, stop rendering after this many seconds even if there are voices still playing
+#define MAX_RENDER_TAIL_SECONDS 30
+
+// rendering a MIDI file without the sound card (see offline_render)
+typedef struct {
+	SoundFont *sound_font; // every preset the MIDI file uses must already be loaded (see use_midi_presets)
+	MidiFile const *midi;
+	SoundThreadData *sound;
+	u16 bank[16]; // set by bank select (controller 0)
+	u32 next_event; // index into midi->events
+	u64 frame; // how many frames have been rendered
+	bool done; // all the events have been handled, and all the voices have finished
+	float *frames_L, *frames_R; // [sound->period]
+} OfflineRender;
+
+static void offline_init(OfflineRender *render, SoundFont *sound_font, MidiFile const *midi,
+	u32 sample_rate, u32 period, u32 polyphony, StealPolicy steal) {
+	memset(render, 0, sizeof *render);
+	render->sound_font = sound_font;
+	render->midi = midi;
+	SoundThreadData *sound = aligned_alloc(64, sizeof *sound);
+	memset(sound, 0, sizeof *sound);
+	sound->sample_rate = sample_rate;
+	sound->period = period;
+	sound->polyphony = polyphony;
+	sound->steal = steal;
+	for (u8 c = 0; c < 16; ++c)
+		sound->channels[c] = default_channel_preset(sound_font, c);
+	render->sound = sound;
+	render->bank[9] = 128;
+	render->frames_L = calloc(period, sizeof *render->frames_L);
+	render->frames_R = calloc(period, sizeof *render->frames_R);
+}
+
+static void offline_free(OfflineRender *render) {
+	SoundThreadData *sound = render->sound;
+	// (give back the voices' instrument references)
+	while (sound->nvoices)
+		voice_remove(sound, sound->nvoices - 1);
+	free(sound);
+	free(render->frames_L);
+	free(render->frames_R);
+	memset(render, 0, sizeof *render);
+}
+
+static void offline_event(OfflineRender *render, MidiEvent const *midi_event) {
+	SoundThreadData *sound = render->sound;
+	u8 channel = midi_event->status & 0xf;
+	u8 key = midi_event->data1, vel = midi_event->data2;
+	Event event = {.channel = channel, .key = key, .vel = vel};
+	switch (midi_event->status >> 4) {
+	case 0x8:
+		event.type = EVENT_NOTE_OFF;
+		break;
+	case 0x9:
+		if (vel == 0) {
+			event.type = EVENT_NOTE_OFF;
+			break;
+		}
+		event.type = EVENT_NOTE_ON;
+		event.instrument = preset_instrument(render->sound_font, sound->channels[channel], key, vel);
+		if (!event.instrument || !event.instrument->samples_loaded) return;
+		// (other renders might be using the same instrument)
+		__atomic_fetch_add(&event.instrument->voice_refs, 1, __ATOMIC_RELAXED);
+		break;
+	case 0xb:
+		if (key == 64) {
+			// sustain pedal
+			event.type = EVENT_SUSTAIN;
+			event.vel = vel >= 64;
 			break;
 		}
-		if (frames_written > 0 && frames_written < (snd_pcm_sframes_t)nframes) {
-			printf("Short write (expected %ld, wrote %ld)\n", (long)nframes, (long)frames_written);
+		if (key == 0 && channel != 9)
+			render->bank[channel] = vel;
+		return;
+	case 0xc: {
+		Preset *preset = find_preset(render->sound_font, render->bank[channel], key);
+		if (preset) sound->channels[channel] = preset;
+	} return;
+	default:
+		return;
+	}
+	handle_event(sound, &event);
+}
+
+// renders the next count frames of the MIDI file into out (interleaved stereo), or if out is NULL,
+// moves everything along exactly as if they'd been rendered. returns the number of frames rendered,
+// which is less than count once the render is done.
+// count must be a multiple of the period. then the output only depends on where the frames are in the file,
+// not on how they're split up into calls (voices are always rendered a period at a time, split at events).
+static u32 offline_render(OfflineRender *render, i16 *out, u32 count) {
+	SoundThreadData *sound = render->sound;
+	MidiFile const *midi = render->midi;
+	u32 period = sound->period;
+	assert(count % period == 0);
+	u64 max_frame = midi->length + (u64)MAX_RENDER_TAIL_SECONDS * sound->sample_rate;
+	u32 rendered = 0;
+	while (rendered < count && !render->done) {
+		// always split things up at the same places, so that the envelopes come out the same
+		u64 frame = render->frame;
+		u32 n = period - (u32)(frame % period);
+		if (n > count - rendered) n = count - rendered;
+		float *frames_L = out ? render->frames_L : NULL, *frames_R = out ? render->frames_R : NULL;
+		if (out) {
+			memset(frames_L, 0, n * sizeof *frames_L);
+			memset(frames_R, 0, n * sizeof *frames_R);
+		}
+		u32 f = 0;
+		while (f < n) {
+			while (render->next_event < midi->nevents && midi->events[render->next_event].frame <= frame + f)
+				offline_event(render, &midi->events[render->next_event++]);
+			u32 next = n;
+			if (render->next_event < midi->nevents && midi->events[render->next_event].frame < frame + n)
+				next = (u32)(midi->events[render->next_event].frame - frame);
+			render_voices(sound, frames_L ? frames_L + f : NULL, frames_R ? frames_R + f : NULL, next - f);
+			f = next;
 		}
+		if (out)
+			kernels.to_s16(out + 2 * rendered, frames_L, frames_R, n);
+		render->frame += n;
+		rendered += n;
+		if (render->next_event == midi->nevents && (sound->nvoices == 0 || render->frame >= max_frame))
+			render->done = true;
+	}
+	return rendered;
+}
 
+// settings for rendering MIDI files (see --render)
+typedef struct {
+	u32 sample_rate;
+	u32 period;
+	u32 polyphony;
+	StealPolicy steal;
+} RenderSettings;
 
-		if (data->out_wav) {
-			u64 old_data_len = (u64)data->out_wav_nframes * 2 /* channels */ * sizeof *frames;
-			u64 new_data_len = old_data_len + nframes * 2 * sizeof *frames; 
-			u64 curr_alloc_size = data->out_wav_data_npages * page_size;
+// each slice of a render split across threads is at least this long (see render_midi_to_wav)
+#define MIN_SLICE_SECONDS 10
+// offset of the samples in WAV files written by write_wav_header
+#define WAV_HEADER_SIZE 44
 
-			pthread_mutex_lock(&data->output_mutex);
-			if (new_data_len >= U32_MAX - 100 /* to be safe */) {
-				printf("Cutting off recording (file too large for WAV format).\n");
-				finish_wav(data, false);
-			} else {
-				if (new_data_len > curr_alloc_size) {
-					size_t additional_pages = 1ul<<14;
-					size_t new_size = curr_alloc_size + page_size * additional_pages; // 64 MB on typical systems
-					data->out_wav_data = mremap(data->out_wav_data, curr_alloc_size, new_size,
-						MREMAP_MAYMOVE);
-					data->out_wav_data_npages += additional_pages;
-				}
+// part of a MIDI file being rendered on its own thread
+typedef struct {
+	SoundFont *sound_font;
+	MidiFile const *midi;
+	RenderSettings const *settings;
+	int fd; // the WAV file
+	u64 start, end; // frames to render. end is UINT64_MAX for the last slice
+	// results
+	bool ok;
+	u64 end_frame; // where rendering actually stopped
+	u64 nvoices; // voices started from the start of the file to the end of the slice
+	u64 nstolen; // voices stolen from the start of the file to the end of the slice
+} RenderSlice;
 
-				memcpy((char *)data->out_wav_data + old_data_len,
-					frames, sizeof frames);
-				data->out_wav_nframes += nframes;
-			}
-			pthread_mutex_unlock(&data->output_mutex);
+static void *render_slice_thread(void *vslice) {
+	RenderSlice *slice = vslice;
+	RenderSettings const *settings = slice->settings;
+	OfflineRender render;
+	offline_init(&render, slice->sound_font, slice->midi, settings->sample_rate, settings->period,
+		settings->polyphony, settings->steal);
+	// get the voices into exactly the state they'd be in at the start of the slice, without mixing anything
+	// (offline_render needs whole periods, and start is at the start of a period)
+	u32 const max_skip = (1u << 30) / settings->period * settings->period;
+	while (render.frame < slice->start && !render.done) {
+		u64 left = slice->start - render.frame;
+		offline_render(&render, NULL, left > max_skip ? max_skip : (u32)left);
+	}
+	u32 const chunk = 64 * settings->period;
+	i16 *buf = malloc(2 * chunk * sizeof *buf);
+	slice->ok = true;
+	while (!render.done && render.frame < slice->end) {
+		u64 frame = render.frame, left = slice->end - frame;
+		u32 n = offline_render(&render, buf, left < chunk ? (u32)left : chunk);
+		size_t size = (size_t)n * 4;
+		if (pwrite(slice->fd, buf, size, (off_t)(WAV_HEADER_SIZE + frame * 4)) != (ssize_t)size)
+			slice->ok = false;
+	}
+	slice->end_frame = render.frame;
+	slice->nvoices = render.sound->voices_started;
+	slice->nstolen = render.sound->voices_stolen;
+	offline_free(&render);
+	free(buf);
+	return NULL;
+}
+
+// renders midi to wav_filename as fast as possible, split into up to nslices pieces of time which
+// are rendered on separate threads. each slice starts from exactly the state a serial render would be in,
+// so the output is the same whatever nslices is. returns false on failure.
+// the number of frames rendered, voices played and voices stolen go in *nframes, *nvoices and *nstolen.
+static bool render_midi_to_wav(SoundFont *sound_font, MidiFile const *midi, char const *wav_filename,
+	RenderSettings const *settings, u32 nslices, u64 *nframes, u64 *nvoices, u64 *nstolen) {
+	*nframes = *nvoices = *nstolen = 0;
+	FILE *fp = fopen(wav_filename, "wb");
+	if (!fp) {
+		warn("Couldn't open %s for writing: %s.", wav_filename, strerror(errno));
+		return false;
+	}
+	write_wav_header(fp, settings->sample_rate, 0); // (we don't know how long it is yet)
+	fflush(fp);
+
+	u64 max_slices = midi->length / ((u64)MIN_SLICE_SECONDS * settings->sample_rate) + 1;
+	if (nslices > max_slices) nslices = (u32)max_slices;
+	if (nslices < 1) nslices = 1;
+	RenderSlice *slices = calloc(nslices, sizeof *slices);
+	u32 period = settings->period;
+	for (u32 i = 0; i < nslices; ++i) {
+		RenderSlice *slice = &slices[i];
+		slice->sound_font = sound_font;
+		slice->midi = midi;
+		slice->settings = settings;
+		slice->fd = fileno(fp);
+		// (slices start at the start of a period, so they're split up the same way a serial render would be)
+		slice->start = midi->length * i / nslices / period * period;
+		if (i > 0) slices[i - 1].end = slice->start;
+	}
+	slices[nslices - 1].end = UINT64_MAX;
+	pthread_t *threads = calloc(nslices, sizeof *threads);
+	bool *started = calloc(nslices, sizeof *started);
+	for (u32 i = 1; i < nslices; ++i)
+		started[i] = pthread_create(&threads[i], NULL, render_slice_thread, &slices[i]) == 0;
+	render_slice_thread(&slices[0]);
+	for (u32 i = 1; i < nslices; ++i) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		else
+			render_slice_thread(&slices[i]);
+	}
+	bool ok = true;
+	for (u32 i = 0; i < nslices; ++i) {
+		ok &= slices[i].ok;
+		if (slices[i].nvoices > *nvoices) *nvoices = slices[i].nvoices;
+		if (slices[i].nstolen > *nstolen) *nstolen = slices[i].nstolen;
+	}
+	*nframes = slices[nslices - 1].end_frame;
+	free(threads);
+	free(started);
+	free(slices);
+	if (!ok) warn("Couldn't write %s.", wav_filename);
+
+	u64 data_size = *nframes * 4;
+	if (data_size >= U32_MAX - 100 /* to be safe */) {
+		warn("%s is too long for a WAV file.", wav_filename);
+		data_size = U32_MAX - 100;
+		ok = false;
+	}
+	fseeko(fp, 0, SEEK_SET);
+	write_wav_header(fp, settings->sample_rate, (u32)data_size);
+	if (fclose(fp) != 0) {
+		warn("Couldn't write %s.", wav_filename);
+		ok = false;
+	}
+	return ok;
+}
+
+// renders midi serially, and checks that it matches the nframes frames in wav_filename exactly
+static bool verify_render(SoundFont *sound_font, MidiFile const *midi, char const *wav_filename,
+	RenderSettings const *settings, u64 nframes) {
+	FILE *fp = fopen(wav_filename, "rb");
+	if (!fp) {
+		warn("Couldn't open %s: %s.", wav_filename, strerror(errno));
+		return false;
+	}
+	fseeko(fp, WAV_HEADER_SIZE, SEEK_SET);
+	OfflineRender render;
+	offline_init(&render, sound_font, midi, settings->sample_rate, settings->period, settings->polyphony, settings->steal);
+	u32 const chunk = 64 * settings->period;
+	i16 *expected = malloc(2 * chunk * sizeof *expected), *got = malloc(2 * chunk * sizeof *got);
+	bool ok = true;
+	u64 frame = 0;
+	while (ok && !render.done) {
+		u32 n = offline_render(&render, expected, chunk);
+		if (fread(got, 4, n, fp) != n) {
+			printf("Verify: %s is too short (%llu frames, should be longer).\n", wav_filename, (unsigned long long)nframes);
+			ok = false;
+		} else if (memcmp(expected, got, (size_t)n * 4) != 0) {
+			u32 i = 0;
+			while (expected[2*i] == got[2*i] && expected[2*i+1] == got[2*i+1]) ++i;
+			printf("Verify: %s differs from a serial render at frame %llu.\n", wav_filename,
+				(unsigned long long)(frame + i));
+			ok = false;
 		}
+		frame += n;
+	}
+	if (ok && frame != nframes) {
+		printf("Verify: %s has %llu frames, but a serial render has %llu.\n", wav_filename,
+			(unsigned long long)nframes, (unsigned long long)frame);
+		ok = false;
+	}
+	if (ok) printf("Verify: %s is identical to a serial render.\n", wav_filename);
+	offline_free(&render);
+	free(expected);
+	free(got);
+	fclose(fp);
+	return ok;
+}
+
+// renders midi_filename to wav_filename on up to nthreads threads, and reports how long it took.
+// if verify is true, this also checks that the result is the same as rendering it on one thread.
+// returns false on failure.
+static bool render_midi_file(SoundFont *sound_font, char const *midi_filename, char const *wav_filename,
+	RenderSettings const *settings, u32 nthreads, bool verify) {
+	MidiFile midi = {0};
+	if (!read_midi_file(midi_filename, settings->sample_rate, &midi))
+		return false;
+	use_midi_presets(sound_font, &midi);
+	u64 start = time_ns();
+	u64 nframes = 0, nvoices = 0, nstolen = 0;
+	bool ok = render_midi_to_wav(sound_font, &midi, wav_filename, settings, nthreads, &nframes, &nvoices, &nstolen);
+	u64 elapsed = time_ns() - start;
+	double audio_seconds = (double)nframes / settings->sample_rate, render_seconds = (double)elapsed * 1e-9;
+	printf("Rendered %s to %s: %.1f s of audio in %.2f s (%.1fx real time), %llu voices (%llu stolen).\n",
+		midi_filename, wav_filename, audio_seconds, render_seconds,
+		render_seconds > 0 ? audio_seconds / render_seconds : 0.0, (unsigned long long)nvoices,
+		(unsigned long long)nstolen);
+	if (ok && verify)
+		ok = verify_render(sound_font, &midi, wav_filename, settings, nframes);
+	free(midi.events);
+	return ok;
+}
+
+// a list of MIDI files being rendered on several threads, all sharing one SoundFont
+typedef struct {
+	SoundFont *sound_font; // every preset any of the files use has been loaded, so this isn't modified while rendering
+	RenderSettings const *settings;
+	u32 njobs;
+	char **midi_filenames;
+	char **wav_filenames;
+	MidiFile *midis;
+	u32 next_job; // accessed atomically
+	u64 nframes; // total frames rendered. accessed atomically.
+	u32 failures; // accessed atomically
+} BatchRender;
+
+static void *batch_thread(void *vbatch) {
+	BatchRender *batch = vbatch;
+	while (1) {
+		u32 j = __atomic_fetch_add(&batch->next_job, 1, __ATOMIC_RELAXED);
+		if (j >= batch->njobs) break;
+		u64 start = time_ns();
+		u64 nframes = 0, nvoices = 0, nstolen = 0;
+		// (the files are rendered in parallel, so each one is only rendered on one thread)
+		bool ok = render_midi_to_wav(batch->sound_font, &batch->midis[j], batch->wav_filenames[j],
+			batch->settings, 1, &nframes, &nvoices, &nstolen);
+		double audio_seconds = (double)nframes / batch->settings->sample_rate;
+		double render_seconds = (double)(time_ns() - start) * 1e-9;
+		printf("[%u/%u] %s: %.1f s of audio in %.2f s (%.1fx real time).\n", j + 1, batch->njobs,
+			batch->wav_filenames[j], audio_seconds, render_seconds, render_seconds > 0 ? audio_seconds / render_seconds : 0.0);
+		__atomic_fetch_add(&batch->nframes, nframes, __ATOMIC_RELAXED);
+		if (!ok) __atomic_fetch_add(&batch->failures, 1, __ATOMIC_RELAXED);
 	}
 	return NULL;
-#undef nframes
 }
 
+// renders every MIDI file listed in list_filename (one per line) to a WAV file next to it, using nthreads threads.
+// returns false if any of them failed.
+static bool render_batch(SoundFont *sound_font, char const *list_filename, RenderSettings const *settings, u32 nthreads) {
+	FILE *list = fopen(list_filename, "r");
+	if (!list) {
+		warn("Couldn't open %s: %s.", list_filename, strerror(errno));
+		return false;
+	}
+	BatchRender batch = {0};
+	batch.sound_font = sound_font;
+	batch.settings = settings;
+	u32 capacity = 0, failures = 0;
+	char line[4096];
+	while (fgets(line, sizeof line, list)) {
+		line[strcspn(line, "\r\n")] = 0;
+		if (!line[0]) continue;
+		if (batch.njobs == capacity) {
+			capacity = capacity ? 2 * capacity : 64;
+			batch.midi_filenames = realloc(batch.midi_filenames, capacity * sizeof *batch.midi_filenames);
+			batch.wav_filenames = realloc(batch.wav_filenames, capacity * sizeof *batch.wav_filenames);
+			batch.midis = realloc(batch.midis, capacity * sizeof *batch.midis);
+		}
+		if (!read_midi_file(line, settings->sample_rate, &batch.midis[batch.njobs])) {
+			++failures;
+			continue;
+		}
+		// foo.mid => foo.wav
+		char *wav = malloc(strlen(line) + 5);
+		strcpy(wav, line);
+		char *dot = strrchr(wav, '.');
+		if (dot && !strchr(dot, '/')) *dot = 0;
+		strcat(wav, ".wav");
+		batch.midi_filenames[batch.njobs] = strdup(line);
+		batch.wav_filenames[batch.njobs] = wav;
+		++batch.njobs;
+	}
+	fclose(list);
+
+	// load everything any of the files need now, so that all the renders can share the samples
+	u64 load_start = time_ns();
+	for (u32 j = 0; j < batch.njobs; ++j)
+		use_midi_presets(sound_font, &batch.midis[j]);
+	printf("Loaded %.1f MB of samples for %u files in %.1f ms.\n",
+		(double)sound_font->sample_bytes_allocated / (1024.0 * 1024.0), (unsigned)batch.njobs,
+		(double)(time_ns() - load_start) * 1e-6);
 
-static SoundThreadData sound_thread_data;
+	if (nthreads > batch.njobs) nthreads = batch.njobs ? batch.njobs : 1;
+	pthread_t *threads = calloc(nthreads, sizeof *threads);
+	u64 start = time_ns();
+	u32 nstarted = 0;
+	for (u32 t = 1; t < nthreads; ++t) {
+		if (pthread_create(&threads[nstarted], NULL, batch_thread, &batch) == 0)
+			++nstarted;
+	}
+	batch_thread(&batch); // this thread does some of the work too
+	for (u32 t = 0; t < nstarted; ++t)
+		pthread_join(threads[t], NULL);
+	u64 elapsed = time_ns() - start;
+	free(threads);
+
+	failures += batch.failures;
+	double audio_seconds = (double)batch.nframes / settings->sample_rate, render_seconds = (double)elapsed * 1e-9;
+	printf("Rendered %u files on %u threads: %.1f s of audio in %.2f s (%.1fx real time)%s.\n",
+		(unsigned)batch.njobs, (unsigned)nstarted + 1, audio_seconds, render_seconds,
+		render_seconds > 0 ? audio_seconds / render_seconds : 0.0, failures ? ", with some failures" : "");
+	for (u32 j = 0; j < batch.njobs; ++j) {
+		free(batch.midis[j].events);
+		free(batch.midi_filenames[j]);
+		free(batch.wav_filenames[j]);
+	}
+	free(batch.midis);
+	free(batch.midi_filenames);
+	free(batch.wav_filenames);
+	return failures == 0;
+}
 
 static void sighandler(int signum) {
 	switch (signum) {
@@ -1117,6 +4310,11 @@ static void sighandler(int signum) {
 		break;
 	}
 	SoundThreadData *sound = &sound_thread_data;
+	fprintf(stderr, "MIDI event queue high-water mark: %u of %d (%llu dropped).\n",
+		(unsigned)__atomic_load_n(&sound->events.high_water, __ATOMIC_RELAXED), EVENT_QUEUE_SIZE,
+		(unsigned long long)__atomic_load_n(&sound->events.dropped, __ATOMIC_RELAXED));
+	if (sound->period)
+		print_stats(stderr, sound);
 	if (sound->out_wav) {
 		finish_wav(sound, true);
 	}
@@ -1127,6 +4325,14 @@ int main(int argc, char **argv) {
 	time_init();
 
 	page_size = (unsigned)sysconf(_SC_PAGE_SIZE);
+#if SMIDI_BENCH
+	// this is smidi_bench (see make bench)
+	(void)argc; (void)argv;
+	simd_init();
+	pitch_init();
+	bench_suite();
+	return 0;
+#endif
 	
 	SoundThreadData *sound = &sound_thread_data;
 	signal(SIGINT, sighandler);
@@ -1140,87 +4346,324 @@ int main(int argc, char **argv) {
 #endif
 
 	char const *sndfont_filename = "/usr/share/sounds/sf2/FluidR3_GM.sf2";
-	if (argc > 1) {
-		sndfont_filename = argv[1];
+	bool use_mmap = false;
+	bool use_index = true;
+	bool bench = false;
+	bool bench_mixing = false;
+	bool preload = false;
+	bool trim_loops = false;
+	u32 stream_head_ms = 0;
+	u32 polyphony = 128;
+	StealPolicy steal = STEAL_RELEASED;
+	u64 memory_budget = 0;
+	u32 nthreads = (u32)sysconf(_SC_NPROCESSORS_ONLN);
+	u32 sample_rate = 44100;
+	u32 period = 441;
+	u32 buffer = 0; // 0 = two periods
+	bool custom_geometry = false; // --period or --buffer was given
+	bool realtime = false;
+	int cpu = -1; // CPU to pin the sound thread to, or -1 for any
+	char const *audio_device = "default";
+	bool mmap_output = true;
+	u32 render_threads = 0;
+	bool deterministic = false;
+	char const *render_midi = NULL, *render_wav = NULL;
+	char const *batch_list = NULL;
+	bool verify = false;
+	u32 stats_interval = 0;
+	char const *stats_filename = NULL;
+	for (int i = 1; i < argc; ++i) {
+		char const *arg = argv[i];
+		if (strcmp(arg, "--mmap") == 0) {
+			use_mmap = true;
+		} else if (strcmp(arg, "--no-index") == 0) {
+			use_index = false;
+		} else if (strcmp(arg, "--preload") == 0) {
+			preload = true;
+		} else if (strcmp(arg, "--trim-loops") == 0) {
+			trim_loops = true;
+		} else if (strcmp(arg, "--stream") == 0 && i + 1 < argc) {
+			stream_head_ms = (u32)atoi(argv[++i]);
+			if (stream_head_ms < 1) die("--stream needs a positive number of milliseconds.");
+		} else if (strcmp(arg, "--memory-budget") == 0 && i + 1 < argc) {
+			memory_budget = (u64)strtoull(argv[++i], NULL, 10) << 20;
+		} else if (strcmp(arg, "--polyphony") == 0 && i + 1 < argc) {
+			polyphony = (u32)atoi(argv[++i]);
+			if (polyphony < 1 || polyphony > MAX_POLYPHONY)
+				die("Polyphony must be between 1 and %d.", MAX_POLYPHONY);
+		} else if (strcmp(arg, "--steal") == 0 && i + 1 < argc) {
+			char const *policy = argv[++i];
+			if (strcmp(policy, "released") == 0)
+				steal = STEAL_RELEASED;
+			else if (strcmp(policy, "oldest") == 0)
+				steal = STEAL_OLDEST;
+			else if (strcmp(policy, "quietest") == 0)
+				steal = STEAL_QUIETEST;
+			else
+				die("Unrecognized voice stealing policy: %s (options are released, oldest, quietest).", policy);
+		} else if (strcmp(arg, "--rate") == 0 && i + 1 < argc) {
+			sample_rate = (u32)atoi(argv[++i]);
+			if (sample_rate < 8000 || sample_rate > 192000)
+				die("Sample rate must be between 8000 and 192000 Hz.");
+		} else if (strcmp(arg, "--period") == 0 && i + 1 < argc) {
+			period = (u32)atoi(argv[++i]);
+			if (period < 16 || period > 16384)
+				die("Period size must be between 16 and 16384 frames.");
+			custom_geometry = true;
+		} else if (strcmp(arg, "--buffer") == 0 && i + 1 < argc) {
+			buffer = (u32)atoi(argv[++i]);
+			if (buffer < 32)
+				die("Buffer size must be at least 32 frames.");
+			custom_geometry = true;
+		} else if (strcmp(arg, "--device") == 0 && i + 1 < argc) {
+			audio_device = argv[++i];
+		} else if (strcmp(arg, "--no-mmap-output") == 0) {
+			mmap_output = false;
+		} else if (strcmp(arg, "--render-threads") == 0 && i + 1 < argc) {
+			// (the sound thread renders too)
+			int n = atoi(argv[++i]);
+			if (n < 1 || n > RENDER_GROUPS)
+				die("Number of render threads must be between 1 and %d.", RENDER_GROUPS);
+			render_threads = (u32)n - 1;
+		} else if (strcmp(arg, "--deterministic") == 0) {
+			deterministic = true;
+		} else if (strcmp(arg, "--render") == 0 && i + 2 < argc) {
+			render_midi = argv[++i];
+			render_wav = argv[++i];
+		} else if (strcmp(arg, "--batch") == 0 && i + 1 < argc) {
+			batch_list = argv[++i];
+		} else if (strcmp(arg, "--verify") == 0) {
+			verify = true;
+		} else if (strcmp(arg, "--stats") == 0 && i + 1 < argc) {
+			int seconds = atoi(argv[++i]);
+			if (seconds < 1) die("--stats needs a positive number of seconds.");
+			stats_interval = (u32)seconds;
+		} else if (strcmp(arg, "--stats-file") == 0 && i + 1 < argc) {
+			stats_filename = argv[++i];
+		} else if (strcmp(arg, "--rt") == 0) {
+			realtime = true;
+		} else if (strcmp(arg, "--cpu") == 0 && i + 1 < argc) {
+			cpu = atoi(argv[++i]);
+			if (cpu < 0 || cpu >= CPU_SETSIZE)
+				die("Bad CPU number: %d.", cpu);
+		} else if (strcmp(arg, "--threads") == 0 && i + 1 < argc) {
+			int n = atoi(argv[++i]);
+			if (n < 1)
+				die("Number of threads must be at least 1.");
+			nthreads = (u32)n;
+		} else if (strcmp(arg, "--bench-parse") == 0) {
+			bench = true;
+		} else if (strcmp(arg, "--bench-mix") == 0) {
+			bench_mixing = true;
+		} else if (arg[0] == '-') {
+			die("Unrecognized option: %s.", arg);
+		} else {
+			sndfont_filename = arg;
+		}
+	}
+	simd_init();
+	pitch_init();
+	if (bench_mixing) {
+		bench_mix();
+		bench_voices();
+		return 0;
 	}
 	FILE *sndfont_fp = fopen(sndfont_filename, "rb");
 	if (!sndfont_fp) {
 		die("Couldn't open soundfont file: %s.", sndfont_filename);
 	}
+	if (bench) {
+		bench_parse(sndfont_fp);
+		return 0;
+	}
 	SoundFont sound_font = {0};
-	read_sound_font(sndfont_fp, &sound_font, false);
+	sound_font.prefault = realtime;
+	if (!use_index || !read_sound_font_index(sndfont_filename, sndfont_fp, &sound_font)) {
+		read_sound_font(sndfont_fp, &sound_font, false);
+		if (use_index)
+			write_sound_font_index(sndfont_filename, &sound_font);
+	}
+	if (use_mmap && stream_head_ms)
+		die("--stream and --mmap can't be used together.");
+	// (there's no sound thread to render, so nothing would stream the samples in)
+	if ((render_midi || batch_list) && stream_head_ms)
+		die("--stream can't be used with --render or --batch.");
+	bool mapped = use_mmap && map_sound_font_samples(&sound_font);
+	// (with --mmap, trimming wouldn't save anything)
+	if ((trim_loops && !mapped) || stream_head_ms) {
+		compute_sample_load_counts(&sound_font, trim_loops && !mapped, stream_head_ms);
+	}
+	if (nthreads < 1) nthreads = 1;
+	if (preload) {
+		preload_instruments(&sound_font, nthreads);
+	}
+	if (render_midi || batch_list) {
+		RenderSettings settings = {.sample_rate = sample_rate, .period = period, .polyphony = polyphony, .steal = steal};
+		bool ok = batch_list ? render_batch(&sound_font, batch_list, &settings, nthreads)
+			: render_midi_file(&sound_font, render_midi, render_wav, &settings, nthreads, verify);
+		return ok ? 0 : EXIT_FAILURE;
+	}
 	
-	Instrument *instrument = NULL;
-	u32 ninsts = sound_font.ninsts;
-	if (ninsts < 1) {
-		die("No instruments. Your soundfont file is probably corrupted.");
-	} else if (ninsts == 2) {
-		instrument = &sound_font.insts[0];
+	Preset *preset = NULL;
+	u32 npresets = sound_font.npresets;
+	if (npresets < 1) {
+		die("No presets. Your soundfont file is probably corrupted.");
+	} else if (npresets == 1) {
+		preset = &sound_font.presets[0];
 	} else {
-		Instrument *default_inst = NULL;
-		printf("Select an instrument:\n");
-		for (u32 i = 0; i < ninsts - 1 /* EOI */; ++i) {
-			Instrument *inst = &sound_font.insts[i];
-			char *name = inst->name;
-			printf("[%u] %s\n", i+1, name);
-			if (!default_inst && (strstr(name, "Piano") || strstr(name, "piano"))) {
-				default_inst = inst;
-			}
+		// General MIDI program 0 is a piano
+		Preset *default_preset = find_preset(&sound_font, 0, 0);
+		if (!default_preset) default_preset = &sound_font.presets[0];
+		printf("Select a preset:\n");
+		for (u32 i = 0; i < npresets; ++i) {
+			Preset *p = &sound_font.presets[i];
+			printf("[%u] %s (bank %u, program %u)\n", i+1, p->name, p->bank, p->preset);
 		}
-		if (!default_inst) default_inst = &sound_font.insts[0];
-		printf("Instrument, enter a number from 1 to %u [default: %s]: ", (unsigned)ninsts-1, default_inst->name);
+		printf("Preset, enter a number from 1 to %u [default: %s]: ", (unsigned)npresets, default_preset->name);
 		fflush(stdout);
 		
 		char line[64];
 		fgets(line, sizeof line, stdin);
 		char *end = NULL;
-		long inum = strtol(line, &end, 10);
-		if (end == line || inum < 1 || inum > ninsts)
-			instrument = default_inst;
+		long pnum = strtol(line, &end, 10);
+		if (end == line || pnum < 1 || pnum > npresets)
+			preset = default_preset;
 		else
-			instrument = &sound_font.insts[inum-1];
+			preset = &sound_font.presets[pnum-1];
 	}
 
-	printf("Selecting instrument %s.\n", instrument->name);
+	printf("Selecting preset %s.\n", preset->name);
 
-	load_instrument(&sound_font, instrument);
-	fclose(sndfont_fp);
-	if (!instrument->samples_loaded) {
-		die("That instrument has no samples. Your soundfont file doesn't actually support it, it seems.");
+	// (we keep the soundfont open, since other instruments might be loaded later)
+	if (!use_preset(&sound_font, preset)) {
+		die("That preset has no samples. Your soundfont file doesn't actually support it, it seems.");
 	}
+	// General MIDI uses channel 10 for drums, which are in bank 128
+	Preset *drums = find_preset(&sound_font, 128, 0);
+	if (drums && !use_preset(&sound_font, drums))
+		drums = NULL;
+	printf("Loaded %.1f MB of samples (%.1f MB saved by sharing samples between zones).\n",
+		(double)sound_font.sample_bytes_allocated / (1024.0 * 1024.0),
+		(double)sound_font.sample_bytes_saved / (1024.0 * 1024.0));
 
 #if 0
 	FILE *out = fopen("out", "wb");
 	for (u8 pitch = 0; pitch < 128; ++pitch)
-		write_note(out, 44100, instrument, pitch, 127);
+		write_note(out, 44100, preset_instrument(&sound_font, preset, pitch, 127), pitch, 127);
 	fclose(out);
 #endif
 	
 	snd_pcm_t *pcm = NULL;
 	{
 		int err = 0;
-		char const *audio_output_device = "default";
-		if ((err = snd_pcm_open(&pcm, audio_output_device, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
+		// SIGUSR1 is only handled by the stats thread (all the other threads are started after this, so they inherit it)
+		sigset_t usr1;
+		sigemptyset(&usr1);
+		sigaddset(&usr1, SIGUSR1);
+		pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+		if ((err = snd_pcm_open(&pcm, audio_device, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
 			die("Playback open error: %s\n", snd_strerror(err));
 		}
-		sound->sample_rate = 44100;
-		if ((err = snd_pcm_set_params(pcm, SND_PCM_FORMAT_S16, SND_PCM_ACCESS_RW_INTERLEAVED,
-			2, sound->sample_rate, 1, 10000)) < 0) {
+		// ask for the period and buffer size we want, and see what we actually get.
+		// without --period or --buffer, ask for what snd_pcm_set_params would with 10 ms of latency
+		// (a 10 ms buffer split into 4 periods), which is what smidi has always used.
+		snd_pcm_hw_params_t *hw = NULL;
+		unsigned buffer_us = DEFAULT_LATENCY_US, period_us = DEFAULT_LATENCY_US / 4;
+		snd_pcm_uframes_t period_frames = period;
+		snd_pcm_uframes_t buffer_frames = buffer ? buffer : 2 * period;
+		snd_pcm_hw_params_malloc(&hw);
+		if ((err = snd_pcm_hw_params_any(pcm, hw)) < 0) {
+			die("Audio set params error: %s\n", snd_strerror(err));
+		}
+		// write straight into the sound card's buffer if we can
+		sound->mmap_output = mmap_output
+			&& snd_pcm_hw_params_set_access(pcm, hw, SND_PCM_ACCESS_MMAP_INTERLEAVED) >= 0;
+		if ((!sound->mmap_output && (err = snd_pcm_hw_params_set_access(pcm, hw, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0)
+			|| (err = snd_pcm_hw_params_set_format(pcm, hw, SND_PCM_FORMAT_S16)) < 0
+			|| (err = snd_pcm_hw_params_set_channels(pcm, hw, 2)) < 0
+			|| (err = snd_pcm_hw_params_set_rate_resample(pcm, hw, 1)) < 0
+			|| (err = snd_pcm_hw_params_set_rate_near(pcm, hw, &sample_rate, NULL)) < 0
+			|| (custom_geometry
+				? (err = snd_pcm_hw_params_set_period_size_near(pcm, hw, &period_frames, NULL)) < 0
+					|| (err = snd_pcm_hw_params_set_buffer_size_near(pcm, hw, &buffer_frames)) < 0
+				: (err = snd_pcm_hw_params_set_buffer_time_near(pcm, hw, &buffer_us, NULL)) < 0
+					|| (err = snd_pcm_hw_params_set_period_time_near(pcm, hw, &period_us, NULL)) < 0)
+			|| (err = snd_pcm_hw_params(pcm, hw)) < 0) {
 			die("Audio set params error: %s\n", snd_strerror(err));
 		}
+		snd_pcm_hw_params_get_rate(hw, &sample_rate, NULL);
+		snd_pcm_hw_params_get_period_size(hw, &period_frames, NULL);
+		snd_pcm_hw_params_get_buffer_size(hw, &buffer_frames);
+		snd_pcm_hw_params_free(hw);
+		snd_pcm_sw_params_t *sw = NULL;
+		snd_pcm_sw_params_malloc(&sw);
+		// start playing once the buffer is full, and wake us up whenever there's room for a period
+		if ((err = snd_pcm_sw_params_current(pcm, sw)) < 0
+			|| (err = snd_pcm_sw_params_set_start_threshold(pcm, sw, buffer_frames - buffer_frames % period_frames)) < 0
+			|| (err = snd_pcm_sw_params_set_avail_min(pcm, sw, period_frames)) < 0
+			|| (err = snd_pcm_sw_params(pcm, sw)) < 0) {
+			die("Audio set software params error: %s\n", snd_strerror(err));
+		}
+		snd_pcm_sw_params_free(sw);
 		snd_pcm_nonblock(pcm, 0); // always block
+		sound->sample_rate = sample_rate;
+		// (by default, we still render 441 frames at a time, whatever the sound card's periods are)
+		sound->period = custom_geometry ? (u32)period_frames : period;
+		printf("Audio: %s, %u Hz, %lu frame periods (%.2f ms), %lu frame buffer (%.2f ms), %s.\n",
+			audio_device, sample_rate, (unsigned long)period_frames, 1000.0 * (double)period_frames / sample_rate,
+			(unsigned long)buffer_frames, 1000.0 * (double)buffer_frames / sample_rate,
+			sound->mmap_output ? "mmap" : "writei");
 
 		sound->pcm = pcm;
-		sound->instrument = instrument;
-		pthread_mutex_init(&sound->mutex, NULL);
+		for (int c = 0; c < 16; ++c)
+			sound->channels[c] = preset;
+		sound->polyphony = polyphony;
+		sound->steal = steal;
+		if (drums)
+			sound->channels[9] = drums;
 		pthread_mutex_init(&sound->output_mutex, NULL);
 
+		if (stream_head_ms) {
+			Streamer *streamer = calloc(1, sizeof *streamer);
+			streamer_init(streamer, &sound_font);
+			pthread_t stream_pthread;
+			if ((err = pthread_create(&stream_pthread, NULL, stream_thread, streamer))) {
+				die("Couldn't create thread (error %d).", err);
+			}
+			sound->streamer = streamer;
+		}
+
 		sound->out_wav_data = mmap(NULL, page_size << 14, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE,
 			-1, 0);
 		sound->out_wav_data_npages = 1ul<<14;
 
+		if (realtime) {
+			// keep everything we've touched (and will touch) in RAM. with MCL_ONFAULT, pages are only locked
+			// once they're used, so the parts of the soundfont mapped with --mmap that aren't loaded,
+			// and the parts of the recording buffer that haven't been recorded into yet, aren't locked.
+			// (samples are touched as they're loaded with --rt, see SoundFont.prefault)
+			int lock_flags = MCL_CURRENT | MCL_FUTURE;
+		#ifdef MCL_ONFAULT
+			if (mlockall(lock_flags | MCL_ONFAULT) == 0)
+				lock_flags = 0;
+			else
+				warn("Couldn't lock memory as it's used (%s). Locking all of it.", strerror(errno));
+		#endif
+			if (lock_flags && mlockall(lock_flags) != 0)
+				warn("Couldn't lock memory: %s.", strerror(errno));
+			sound->realtime = true;
+		}
+		render_pool_init(sound, render_threads, deterministic, cpu);
 		pthread_t sound_pthread;
-		if ((err = pthread_create(&sound_pthread, NULL, sound_thread, sound))) {
+		if ((err = create_audio_thread(&sound_pthread, sound_thread, sound, realtime, cpu))) {
+			die("Couldn't create thread (error %d).", err);
+		}
+		StatsThreadData *stats_data = calloc(1, sizeof *stats_data);
+		stats_data->sound = sound;
+		stats_data->interval = stats_interval;
+		stats_data->filename = stats_filename;
+		pthread_t stats_pthread;
+		if ((err = pthread_create(&stats_pthread, NULL, stats_thread, stats_data))) {
 			die("Couldn't create thread (error %d).", err);
 		}
 	}
@@ -1275,29 +4718,22 @@ int main(int argc, char **argv) {
 		die("Couldn't access MIDI device %s.", device_filename);
 	}
 	
-	bool sustain_pedal = false; // is the sustain pedal down?
+	u16 bank[16] = {0}; // set by bank select (controller 0)
+	bank[9] = 128;
 
 	while (1) {
 		int c = getc(device);
 		if (c == EOF) break;
 		if (!(c & 0x80)) continue; // data
 		int top4 = (c & 0xf0) >> 4;
+		int channel = c & 0x0f;
 		switch (top4) {
 		case 8: {
 			// Note off
 			u8 n = (u8)getc(device);
 			u8 v = (u8)getc(device);
 			if (n > 127 || v > 127) break;
-			sound_lock(sound);
-			Note *note = &sound->notes[n];
-			if (note->exists) {
-				note->down = false;
-				if (!sustain_pedal) {
-					note->dampened = true;
-					note->dampening = 1.0f;
-				}
-			}
-			sound_unlock(sound);
+			send_event(sound, EVENT_NOTE_OFF, (u8)channel, n, v, NULL);
 		} break;
 		case 9: {
 			// Note on
@@ -1305,18 +4741,10 @@ int main(int argc, char **argv) {
 			u8 v = (u8)getc(device);
 			if (n > 127 || v > 127) break;
 			if (feof(device)) break;
-			sound_lock(sound);
-			Note *note = &sound->notes[n];
-			if (note) {
-				note->exists = true;
-				note->vel = v;
-				note->pos = 0;
-				note->dampening = 1;
-				note->dampened = false;
-				note->down = true;
-			}
-			sound_unlock(sound);
-
+			Instrument *inst = preset_instrument(&sound_font, sound->channels[channel], n, v);
+			if (!inst || !inst->samples_loaded) break;
+			inst->last_used = time_ns();
+			send_event(sound, EVENT_NOTE_ON, (u8)channel, n, v, inst);
 		} break;
 		case 11: { // controller
 			u8 controller = (u8)getc(device);
@@ -1324,24 +4752,13 @@ int main(int argc, char **argv) {
 			if (controller > 127 || vel > 127) break;
 			if (controller == 64) {
 				// sustain pedal
-				sound_lock(sound);
 				if (vel == 0) { // oddly, 0 velocity is down (at least on my keyboard)
-					sustain_pedal = true;
-					for (Note *no = sound->notes, *end = no + 128; no < end; ++no) {
-						no->dampened = false;
-					}
+					send_event(sound, EVENT_SUSTAIN, (u8)channel, 0, 1, NULL);
 				} else if (vel == 127) {
-					sustain_pedal = false;
-					for (Note *no = sound->notes, *end = no + 128; no < end; ++no) {
-						if (!no->down) {
-							no->dampened = true;
-						}
-					}
+					send_event(sound, EVENT_SUSTAIN, (u8)channel, 0, 0, NULL);
 				}
-				sound_unlock(sound);
 			} else if (controller == 48) {
 				// record to wav
-				sound_lock(sound);
 				if (vel == 127) {
 					pthread_mutex_lock(&sound->output_mutex);
 					sound->out_wav = true;
@@ -1350,13 +4767,35 @@ int main(int argc, char **argv) {
 					if (sound->out_wav)
 						finish_wav(sound, true);
 				}
-				sound_unlock(sound);
+			} else if (controller == 0) {
+				// bank select (the next program change will use it)
+				// channel 10 always uses the drum bank
+				if (channel != 9)
+					bank[channel] = vel;
 			} else {
 			#if 0
 				printf("%u %u\n",controller,vel);
 			#endif
 			}
 		} break;
+		case 12: {
+			// Program change
+			u8 program = (u8)getc(device);
+			if (program > 127) break;
+			Preset *new_preset = find_preset(&sound_font, bank[channel], program);
+			if (!new_preset) {
+				warn("No preset for bank %u program %u.", bank[channel], program);
+				break;
+			}
+			if (!use_preset(&sound_font, new_preset)) {
+				warn("Preset %s has no samples.", new_preset->name);
+				break;
+			}
+			sound->channels[channel] = new_preset;
+			evict_instruments(sound, &sound_font, memory_budget);
+			if (verbose) printf("Channel %d: %s (%.1f MB of samples loaded)\n", channel + 1, new_preset->name,
+				(double)sound_font.sample_bytes_allocated / (1024.0 * 1024.0));
+		} break;
 		default:
 		#if 0
 			printf("%d\n", top4);